@@ -4,6 +4,26 @@
 #define VER "1.0"
 #define TABSIZE 4
 #define QUIT_TIME 2
+#define INDEX_BLOCK (1 << 20) //bytes read per pread while scanning for newlines
+#define INDEX_CHUNK (16 << 20) //bytes indexed per idle step before redrawing
+#define PIPE_BUF_SIZE (1 << 16) //bytes handed to a compressor per write
+#define HISTORY_MAX 32
+#define HASH_BLOCK (1 << 16) //granularity of change detection on the opened file
+#define SESSION_SAMPLES 16 //blocks hashed to check a cached index still matches the file
+#define SESSION_SAMPLE_SIZE 4096
+#define HEX_ROW 16 //bytes on a row of the hex view
+#define HEX_PAGE 4096 //granularity of the written back parts of the hex view
+#define RECORD_MAGIC "TEREC01\n"
+#define CLIENT_MAGIC "TECLI01\n"
+#define SERVER_IDLE 3600 //seconds a server with a saved document waits for clients
+#define DEPTH_ROW_MAX (1 << 16) //longest row whose nesting is shown before a bracket command needs it
+#define EVEN_BITS 0x5555555555555555ULL //bytes at even positions of a 64 byte block
+#define THREADS_MAX 16 //threads a command over many rows is split across
+#define THREAD_ROWS_MIN 8192 //rows worth starting a thread for
+#define PIPE_IOV 1024 //row pieces handed to vmsplice at once
+#define COLUMN_MAX 32 //widest a column is drawn in column mode, longer fields are cut
+#define COLUMN_SEP " | "
+#define COLUMN_SEP_LEN 3
 
 #include <unistd.h>
 #include <termios.h>
@@ -16,6 +36,19 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef struct termios terminal;
 
@@ -27,14 +60,103 @@ typedef struct erow
 
     int rsize;
     char *render;
+
+    off_t foff; //Offset of the line in the opened file, used while chars is not loaded
+
+    int *fields; //Start of each field in chars, found when columns are shown
+    int nfields; //-1 until the fields are found
+
+    struct rowNest *nest; //Brackets of the row, NULL until a bracket command needs them
 } erow;
 
+//Bracket count of a piece of text, carried across calls like the inWord of countWords
+typedef struct nesting
+{
+    int net; //Opening minus closing brackets
+    int low; //Lowest net reached, 0 or less
+    int quoted; //Inside a string
+    int escaped; //Next byte follows a backslash
+} nesting;
+#define NESTING_INIT {0, 0, 0, 0}
+
+//An opening or closing bracket outside strings
+typedef struct bracket
+{
+    int at; //Column in chars
+    int depth; //Nesting before it, counted from the start of the row
+    int pair; //Index of the matching bracket in the row, -1 if it is in another row
+    int up; //Index of the opening bracket around the text after it, -1 if it is in an earlier row
+} bracket;
+
+//Brackets of a row in order
+typedef struct rowNest
+{
+    bracket *b;
+    int n;
+    int net, low;
+    int *loose; //Brackets matched in other rows, the closing ones first
+    int closing; //Closing brackets in loose, which is -low
+} rowNest;
+
+//Node of the treap which keeps row statistics, ordered by row position
+typedef struct statNode
+{
+    int left, right;
+    unsigned int prio;
+    int count; //Rows in the subtree
+    int bytes, words; //Of this row, bytes includes the newline
+    long long sumBytes, sumWords; //Of the whole subtree
+    int net, low; //Brackets of this row, see nesting
+    long long sumNet, minNet; //Of the whole subtree, minNet is the lowest prefix and 0 or less
+    int hidden; //Row is inside a fold
+    int visible; //Rows of the subtree not hidden
+    int tag; //Pending for the children: 0 nothing, 1 show all, 2 hide all
+} statNode;
+
+//Earlier answers to a prompt, oldest first
+typedef struct history
+{
+    char *items[HISTORY_MAX];
+    int len;
+} history;
+
 /*This struct contains the buffer which we have to output in terminal*/
 typedef struct abuf{
     char *s;
     int len;
 } abuf;
 #define ABUF_INIT {NULL, 0}
+
+//Window of the opened file for reading many rows without loading them
+typedef struct rowReader
+{
+    char *buf;
+    off_t off;
+    int len;
+} rowReader;
+#define READER_INIT {NULL, 0, 0}
+
+//An extra cursor, the main one is cx and cy
+typedef struct cursor
+{
+    int x, y;
+    int main; //Set on the main cursor while edits are applied
+} cursor;
+
+//What the last command over a range of rows changed, to put it back
+typedef struct undoRecord
+{
+    int set;
+    int from;
+    int rows, newRows; //In the range before and after the command
+    int *source; //For each row after the command its place in the range before, -1 if it is new
+    erow *gone; //Rows the command removed, with their place in the range
+    int *goneAt;
+    int goneLen;
+    int tree; //Statistics of the range before the command
+    int dirty; //Value of config.dirty right after it, later edits make it stale
+    int srcFd; //File replaced by a save which unloaded gone rows still point into, -1 if none
+} undoRecord;
 /**---terminal---**/
 
 typedef enum keys{
@@ -47,6 +169,10 @@ typedef enum keys{
     HOME = 1006,
     END = 1007,
     DEL = 1008,
+    DOC_HOME = 1009,
+    DOC_END = 1010,
+    CTRL_LEFT = 1011,
+    CTRL_RIGHT = 1012,
     BACKSPACE = 127,
 } splKeys;
 
@@ -58,22 +184,177 @@ typedef struct estate
     unsigned short int screenrows;
     unsigned short int screencols;
     int numrow;
+    int rowCap; //Allocated slots in row
     int colOff;
     int rowOff; //for scrolling
     erow *row; //Stores a row of text from the file
+
+    //Line index of the opened file, rows are appended as newlines are found
+    int srcFd;
+    off_t srcSize;
+    off_t scanOff; //Bytes of the file scanned so far
+    off_t lineStart; //Start of the line being scanned
+    char scanLast; //Last byte of the previous block, to trim \r across blocks
+
+    int scanWords; //Words seen so far in the line being scanned
+    int scanInWord;
+    nesting scanNest;
+
+    //Per row byte and word counts, node 0 is the empty tree
+    statNode *stat;
+    int statCap;
+    int statUsed;
+    int statFree; //Free list linked through left
+    int statRoot;
+
+    int compress; //Index in formats, 0 for plain text
+
+    //Hashes of the HASH_BLOCK sized blocks of the file as it was loaded
+    unsigned long long *blockHash;
+    int blockCap;
+    off_t hashOff; //Bytes hashed so far
+    struct stat disk; //File status when it was loaded or saved
+    time_t diskChecked;
+    int diskChanged; //A change on disk was noticed and not reloaded yet
+    int diskPartial; //Only the rows of the byte range below have to be reloaded
+    off_t changeStart, changeOldEnd, changeNewEnd;
+
+    //Column mode, widths are measured on the rows colFrom to colTo around the screen
+    int columnMode;
+    char delim;
+    int *colWidth;
+    int *colStart; //Render column where each column begins, colCount + 1 entries
+    int colCount;
+    int colCap;
+    int colFrom, colTo;
+    int colStale; //A widest field got shorter, measure again
+
+    //Hex view over a private mapping of the opened file
+    int hexMode;
+    unsigned char *hexMap;
+    off_t hexSize;
+    off_t hexOff; //First byte shown, a multiple of HEX_ROW
+    off_t hexCursor;
+    int hexNibble; //Low half of the byte is edited next
+    int hexAscii; //Typing goes to the text column
+    int hexDirty; //Bytes changed since the last save
+    int hexSaved; //The file changed under the rows, reload them on leaving
+    unsigned char *hexPages; //Bitmap of the HEX_PAGE pages to write back
+
+    //Extra cursors sorted by row then column, edits are applied at all of them
+    cursor *cursors;
+    int ncursors;
+    int cursorCap;
+
+    undoRecord undo;
+
+    int markSet; //Selection runs from the mark to the cursor
+    int mx, my;
+
+    history searchHistory;
     int dirty;
     char *filename;
-    char statusMsg[80];
+    char statusMsg[128];
     time_t statusMsgTime;
     terminal original;
+    int rawMode; //The terminal has to be restored and cleared on errors
+
+    //Output layer, frame holds the lines being drawn and shadow what the terminal shows
+    int syncOutput; //Terminal supports synchronized updates (mode 2026)
+    abuf *frame;
+    abuf *shadow;
+    int *shadowWidth;
+    int termY, termX; //Where the terminal cursor is, -1 if unknown
+    int frameBytes; //Written by the last refresh
+    long long frameTotal;
+    long long frameCount;
+    int showFrameStats;
+
+    //Server mode, input and output belong to the client being served
+    int inFd, outFd;
+    int serving;
+    int clientGone; //The client being served left or quit
+
+    //Keystroke recording and replay
+    FILE *record;
+    long long recordLast; //Time of the last recorded byte in microseconds
+    FILE *replay; //Input comes from a recording instead of the terminal
+    long long keyStart; //When the key being replayed was read, 0 once it is drawn
+    int keyCode;
+
+    //Keys typed while a command ran, read before the terminal once it is done
+    int *keyQueue;
+    int keyQueued, keyQueueCap;
+
+    int unfolded; //Hidden rows shown by the last command, its new rows can't keep the folds
 } editorState;
 editorState config;
 
 
+//A client attached to the server, with its own view of the document
+typedef struct client
+{
+    int fd;
+    int cx, cy, rx, rowOff, colOff;
+    unsigned short int screenrows, screencols;
+    int markSet, mx, my;
+    cursor *cursors;
+    int ncursors, cursorCap;
+    int syncOutput;
+    abuf *frame, *shadow;
+    int *shadowWidth;
+    int termY, termX;
+    char statusMsg[128];
+    time_t statusMsgTime;
+} client;
+
+//Sent by a client when it connects, followed by the raw terminal input
+typedef struct clientHello
+{
+    char magic[8];
+    unsigned short int rows, cols;
+    int syncOutput;
+} clientHello;
+
+
 /***prototype*/
 void setStatusMsg(const char *fmt, ...);
 void refreshScreen();
 char *promptUser(char *prompt, void(*callback)(char *, int));
+char *promptHistory(char *prompt, void(*callback)(char *, int), history *h);
+void indexRows(int n);
+void indexTo(off_t upto);
+int isIndexing();
+void initDocument();
+void initEditor();
+void saveSession();
+void loadSession();
+void checkDisk();
+void forgetFields(erow *row);
+void forgetNest(erow *row);
+void layoutRow(erow *row);
+int columnCxToRx(erow *row, int cx);
+int diskDiverged();
+int confirmOverwrite();
+char delimiterForName(const char *filename);
+void reloadFile();
+int readKey();
+int readByte(char *c, int wait);
+void keyRead(int c);
+int finishKey(char c);
+void recordByte(int b);
+rowNest *nestOf(int at);
+int blockEnd(int at, int cx, int *y, int *x);
+void keyDone();
+void abAppend(abuf *ab, const char *s, int len);
+void moveCursor(int key);
+void jumpTo(int at, int cx);
+void hexOpen();
+void statFreeTree(int t);
+void dropUndo();
+void undoRange();
+void releaseSource();
+void commandPrompt();
 
 /**
  * @brief Outputs the error in screen and exits
@@ -84,8 +365,11 @@ void err(const char *s)
 {
 
     //Clear screen if error occurs then exit
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    if(config.rawMode)
+    {
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+    }
 
     perror(s);
     printf("\r\n");
@@ -110,6 +394,7 @@ void enableRawMode()
     terminal raw;
     if(tcgetattr(STDIN_FILENO, &config.original) == -1) err("tcgetattr failure"); //Storing terminal settings in struct raw
     atexit(exitRawMode);
+    config.rawMode = 1;
     raw = config.original;
 
 
@@ -129,11 +414,564 @@ void enableRawMode()
 
 }
 
+/**
+ * @brief Asks the terminal which optional features it has
+ *
+ * The query for synchronized output is followed by a primary device attributes
+ * request which every terminal answers, so terminals which ignore the first
+ * query are detected without waiting for a timeout.
+ */
+void probeTerminal()
+{
+    config.syncOutput = 0;
+    const char *query = "\x1b[?2026$p\x1b[c";
+    if(write(STDOUT_FILENO, query, strlen(query)) != (ssize_t)strlen(query)) return;
+    char reply[128];
+    int len = 0;
+    while(len < (int)sizeof(reply) - 1)
+    {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if(poll(&pfd, 1, 200) <= 0) break;
+        if(read(STDIN_FILENO, &reply[len], 1) != 1) break;
+        len++;
+        if(reply[len-1] == 'c') break; //Device attributes come last, the mode reply ends with $y
+    }
+    reply[len] = 0;
+    char *mode = strstr(reply, "\x1b[?2026;");
+    if(mode)
+    {
+        int state = atoi(mode + 8);
+        config.syncOutput = state == 1 || state == 2; //0 and 4 mean it can't be used
+    }
+}
+
+/**row statistics**/
+
+int isWordSep(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/**
+ * @brief Counts the words in s, inWord carries the state across calls
+ *
+ * @param s
+ * @param len
+ * @param inWord
+ * @return int
+ */
+int countWords(const char *s, int len, int *inWord)
+{
+    int words = 0;
+    int in = *inWord;
+    for(int j = 0; j<len; j++)
+    {
+        if(isWordSep(s[j])) in = 0;
+        else if(!in)
+        {
+            in = 1;
+            words++;
+        }
+    }
+    *inWord = in;
+    return words;
+}
+
+/**
+ * @brief Finds the brackets outside strings in up to 64 bytes of text
+ *
+ * Quotes, backslashes and brackets are found as bitmasks. Escaped quotes are
+ * removed with a carry running along each backslash run, and the bytes inside
+ * strings are the prefix xor of the quotes, so no byte is looked at by itself.
+ * Escaped brackets are not counted either.
+ *
+ * @param s
+ * @param n bytes of text in s, 64 or less
+ * @param st quote and escape state, carried to the next call
+ * @param close set to the closing brackets
+ * @return unsigned long long the opening brackets, bit j is s[j]
+ */
+unsigned long long nestBits(const char *s, int n, nesting *st, unsigned long long *close)
+{
+    unsigned long long quote = 0, slash = 0, open = 0, shut = 0;
+    char tail[64];
+    if(n < 64)
+    {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, s, n);
+        s = tail;
+    }
+#ifdef __SSE2__
+    //[ and { differ by one bit, as do ] and }
+    __m128i lower = _mm_set1_epi8(0x20), brace = _mm_set1_epi8('{'), unbrace = _mm_set1_epi8('}');
+    __m128i paren = _mm_set1_epi8('('), unparen = _mm_set1_epi8(')');
+    __m128i q = _mm_set1_epi8('"'), b = _mm_set1_epi8('\\');
+    for(int j = 0; j<64; j += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + j));
+        __m128i low = _mm_or_si128(v, lower);
+        quote |= (unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, q)) << j;
+        slash |= (unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, b)) << j;
+        open |= (unsigned long long)(unsigned int)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(low, brace), _mm_cmpeq_epi8(v, paren))) << j;
+        shut |= (unsigned long long)(unsigned int)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(low, unbrace), _mm_cmpeq_epi8(v, unparen))) << j;
+    }
+#else
+    for(int j = 0; j<n; j++)
+    {
+        unsigned long long bit = 1ULL << j;
+        switch(s[j])
+        {
+            case '"': quote |= bit; break;
+            case '\\': slash |= bit; break;
+            case '(': case '[': case '{': open |= bit; break;
+            case ')': case ']': case '}': shut |= bit; break;
+        }
+    }
+#endif
+    //A byte is escaped when an odd run of backslashes ends right before it
+    unsigned long long carry = st->escaped;
+    slash &= ~carry;
+    unsigned long long follows = slash << 1 | carry;
+    unsigned long long oddStarts = slash & ~EVEN_BITS & ~follows;
+    unsigned long long runs = oddStarts + slash;
+    unsigned long long escaped = (EVEN_BITS ^ (runs << 1)) & follows;
+    st->escaped = n < 64 ? (escaped >> n) & 1 : runs < oddStarts;
+    quote &= ~escaped;
+    open &= ~escaped;
+    shut &= ~escaped;
+
+    unsigned long long in = quote;
+    for(int k = 1; k<64; k <<= 1) in ^= in << k;
+    if(st->quoted) in = ~in;
+    st->quoted = (in >> (n - 1)) & 1;
+    *close = shut & ~in;
+    return open & ~in;
+}
+
+/**
+ * @brief Counts the brackets in s, st carries the state across calls
+ *
+ * Strings are double quoted and end with the line, as in JSON.
+ *
+ * @param s
+ * @param len
+ * @param st
+ */
+void countNesting(const char *s, int len, nesting *st)
+{
+    for(int j = 0; j<len; j += 64)
+    {
+        unsigned long long close, open = nestBits(s + j, len - j < 64 ? len - j : 64, st, &close);
+        if(close == 0)
+        {
+            st->net += __builtin_popcountll(open);
+            continue;
+        }
+        unsigned long long all = open | close;
+        while(all)
+        {
+            unsigned long long bit = all & -all;
+            all ^= bit;
+            if(open & bit) st->net++;
+            else if(--st->net < st->low) st->low = st->net;
+        }
+    }
+}
+
+unsigned int statRand()
+{
+    static unsigned int x = 2463534242u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+int statNew(int bytes, int words, int net, int low)
+{
+    int t;
+    if(config.statFree)
+    {
+        t = config.statFree;
+        config.statFree = config.stat[t].left;
+    }
+    else
+    {
+        if(config.statUsed == config.statCap)
+        {
+            config.statCap *= 2;
+            config.stat = realloc(config.stat, sizeof(statNode) * config.statCap);
+            if(config.stat == NULL) err("Stat allocation problems");
+        }
+        t = config.statUsed++;
+    }
+    statNode *n = &config.stat[t];
+    n->left = n->right = 0;
+    n->prio = statRand();
+    n->count = 1;
+    n->bytes = bytes;
+    n->words = words;
+    n->sumBytes = bytes;
+    n->sumWords = words;
+    n->net = n->sumNet = net;
+    n->low = n->minNet = low;
+    n->hidden = n->tag = 0;
+    n->visible = 1;
+    return t;
+}
+
+//Hides or shows a whole subtree, its children are updated when they are reached
+void statApply(int t, int hide)
+{
+    if(t == 0) return;
+    statNode *n = &config.stat[t];
+    n->hidden = hide;
+    n->visible = hide ? 0 : n->count;
+    n->tag = hide + 1;
+}
+
+void statPush(int t)
+{
+    statNode *n = &config.stat[t];
+    if(t == 0 || n->tag == 0) return;
+    statApply(n->left, n->tag - 1);
+    statApply(n->right, n->tag - 1);
+    n->tag = 0;
+}
+
+void statPull(int t)
+{
+    statNode *n = &config.stat[t];
+    statNode *l = &config.stat[n->left];
+    statNode *r = &config.stat[n->right];
+    n->count = l->count + 1 + r->count;
+    n->sumBytes = l->sumBytes + n->bytes + r->sumBytes;
+    n->sumWords = l->sumWords + n->words + r->sumWords;
+    n->sumNet = l->sumNet + n->net + r->sumNet;
+    n->minNet = l->minNet;
+    if(l->sumNet + n->low < n->minNet) n->minNet = l->sumNet + n->low;
+    if(l->sumNet + n->net + r->minNet < n->minNet) n->minNet = l->sumNet + n->net + r->minNet;
+    n->visible = l->visible + !n->hidden + r->visible;
+}
+
+//Splits t into the first k rows and the rest
+void statSplit(int t, int k, int *l, int *r)
+{
+    if(t == 0)
+    {
+        *l = *r = 0;
+        return;
+    }
+    statPush(t);
+    int lc = config.stat[config.stat[t].left].count;
+    if(k <= lc)
+    {
+        int ll;
+        statSplit(config.stat[t].left, k, &ll, &config.stat[t].left);
+        *l = ll;
+        *r = t;
+    }
+    else
+    {
+        int rr;
+        statSplit(config.stat[t].right, k - lc - 1, &config.stat[t].right, &rr);
+        *l = t;
+        *r = rr;
+    }
+    statPull(t);
+}
+
+int statMerge(int l, int r)
+{
+    if(l == 0) return r;
+    if(r == 0) return l;
+    if(config.stat[l].prio > config.stat[r].prio)
+    {
+        statPush(l);
+        int m = statMerge(config.stat[l].right, r);
+        config.stat[l].right = m;
+        statPull(l);
+        return l;
+    }
+    statPush(r);
+    int m = statMerge(l, config.stat[r].left);
+    config.stat[r].left = m;
+    statPull(r);
+    return r;
+}
+
+/**
+ * @brief Builds a treap of n rows in O(n), keeping the right spine on a stack
+ *
+ * @param bytes
+ * @param words
+ * @param nets
+ * @param lows
+ * @param n
+ * @return int root of the new tree
+ */
+int statBuild(const int *bytes, const int *words, const int *nets, const int *lows, int n)
+{
+    int *spine = malloc(sizeof(int) * (n + 1));
+    int top = 0;
+    for(int j = 0; j<n; j++)
+    {
+        int t = statNew(bytes[j], words[j], nets[j], lows[j]);
+        int last = 0;
+        while(top && config.stat[spine[top-1]].prio < config.stat[t].prio)
+        {
+            last = spine[--top];
+            statPull(last);
+        }
+        config.stat[t].left = last;
+        if(top) config.stat[spine[top-1]].right = t;
+        spine[top++] = t;
+    }
+    while(top > 1) statPull(spine[--top]);
+    int root = 0;
+    if(top)
+    {
+        root = spine[0];
+        statPull(root);
+    }
+    free(spine);
+    return root;
+}
+
+void statInsert(int pos, int bytes, int words, int net, int low)
+{
+    int l, r;
+    statSplit(config.statRoot, pos, &l, &r);
+    config.statRoot = statMerge(statMerge(l, statNew(bytes, words, net, low)), r);
+}
+
+//Adds already built rows at the end of the document
+void statAppend(int tree)
+{
+    config.statRoot = statMerge(config.statRoot, tree);
+}
+
+void statErase(int pos)
+{
+    int l, m, r;
+    statSplit(config.statRoot, pos, &l, &r);
+    statSplit(r, 1, &m, &r);
+    if(m)
+    {
+        config.stat[m].left = config.statFree;
+        config.statFree = m;
+    }
+    config.statRoot = statMerge(l, r);
+}
+
+void statSetAt(int t, int pos, int bytes, int words, int net, int low)
+{
+    statPush(t);
+    int lc = config.stat[config.stat[t].left].count;
+    if(pos < lc) statSetAt(config.stat[t].left, pos, bytes, words, net, low);
+    else if(pos > lc) statSetAt(config.stat[t].right, pos - lc - 1, bytes, words, net, low);
+    else
+    {
+        config.stat[t].bytes = bytes;
+        config.stat[t].words = words;
+        config.stat[t].net = net;
+        config.stat[t].low = low;
+    }
+    statPull(t);
+}
+
+/**
+ * @brief Sums the bytes and words of the rows before pos
+ *
+ * @param pos
+ * @param words may be NULL
+ * @return long long bytes
+ */
+long long statPrefix(int pos, long long *words)
+{
+    long long b = 0, w = 0;
+    int t = config.statRoot;
+    while(t)
+    {
+        statNode *n = &config.stat[t];
+        int lc = config.stat[n->left].count;
+        if(pos <= lc) t = n->left;
+        else
+        {
+            b += config.stat[n->left].sumBytes + n->bytes;
+            w += config.stat[n->left].sumWords + n->words;
+            pos -= lc + 1;
+            t = n->right;
+        }
+    }
+    if(words) *words = w;
+    return b;
+}
+
+//Returns the row which contains byte off, numrow if off is past the end
+int statFind(long long off)
+{
+    int at = 0;
+    int t = config.statRoot;
+    while(t)
+    {
+        statNode *n = &config.stat[t];
+        statNode *l = &config.stat[n->left];
+        if(off < l->sumBytes) t = n->left;
+        else
+        {
+            off -= l->sumBytes;
+            at += l->count;
+            if(off < n->bytes) return at;
+            off -= n->bytes;
+            at++;
+            t = n->right;
+        }
+    }
+    return at;
+}
+
+//Opening minus closing brackets in the rows before pos
+long long nestBefore(int pos)
+{
+    long long net = 0;
+    int t = config.statRoot;
+    while(t)
+    {
+        statNode *n = &config.stat[t];
+        int lc = config.stat[n->left].count;
+        if(pos <= lc) t = n->left;
+        else
+        {
+            net += config.stat[n->left].sumNet + n->net;
+            pos -= lc + 1;
+            t = n->right;
+        }
+    }
+    return net;
+}
+
+/**
+ * @brief Finds the first row of [from, to) where the nesting falls to target or below
+ *
+ * @param t subtree, its first row is base and the nesting before it is depth
+ * @param last finds the last such row instead
+ * @return int row, -1 if there is none
+ */
+int statDrop(int t, int base, long long depth, int from, int to, long long target, int last)
+{
+    if(t == 0) return -1;
+    statNode *n = &config.stat[t];
+    if(base >= to || base + n->count <= from || depth + n->minNet > target) return -1;
+    statNode *l = &config.stat[n->left];
+    int at = base + l->count;
+    long long mid = depth + l->sumNet; //Before this row
+    int found = last ? statDrop(n->right, at + 1, mid + n->net, from, to, target, 1)
+        : statDrop(n->left, base, depth, from, to, target, 0);
+    if(found != -1) return found;
+    if(at >= from && at < to && mid + n->low <= target) return at;
+    return last ? statDrop(n->left, base, depth, from, to, target, 1)
+        : statDrop(n->right, at + 1, mid + n->net, from, to, target, 0);
+}
+
+//Visible rows before pos, which is the screen line of pos without scrolling
+int visibleBefore(int pos)
+{
+    int v = 0;
+    int t = config.statRoot;
+    while(t)
+    {
+        statNode *n = &config.stat[t];
+        if(n->tag) return v + (n->tag == 1 ? pos : 0); //Whole subtree is alike
+        int lc = config.stat[n->left].count;
+        if(pos <= lc) t = n->left;
+        else
+        {
+            v += config.stat[n->left].visible + !n->hidden;
+            pos -= lc + 1;
+            t = n->right;
+        }
+    }
+    return v;
+}
+
+//Row shown on screen line k without scrolling, rows past the indexed part count as shown
+int rowAtScreen(int k)
+{
+    if(k < 0) k = 0;
+    int total = config.stat[config.statRoot].visible;
+    if(k >= total) return config.numrow + k - total;
+    int at = 0;
+    int t = config.statRoot;
+    while(t)
+    {
+        statNode *n = &config.stat[t];
+        if(n->tag) return at + k; //All shown, k < visible
+        statNode *l = &config.stat[n->left];
+        if(k < l->visible) t = n->left;
+        else
+        {
+            k -= l->visible;
+            at += l->count;
+            if(!n->hidden)
+            {
+                if(k == 0) return at;
+                k--;
+            }
+            at++;
+            t = n->right;
+        }
+    }
+    return at;
+}
+
+int isHidden(int pos)
+{
+    int t = config.statRoot;
+    while(t)
+    {
+        statNode *n = &config.stat[t];
+        if(n->tag) return n->tag == 2;
+        int lc = config.stat[n->left].count;
+        if(pos < lc) t = n->left;
+        else if(pos > lc)
+        {
+            pos -= lc + 1;
+            t = n->right;
+        }
+        else return n->hidden;
+    }
+    return 0;
+}
+
+//Hides or shows the rows [from, to)
+void statSetHidden(int from, int to, int hide)
+{
+    int l, m, r;
+    statSplit(config.statRoot, from, &l, &r);
+    statSplit(r, to - from, &m, &r);
+    statApply(m, hide);
+    config.statRoot = statMerge(statMerge(l, m), r);
+}
+
+//Recounts a row after its text changed
+void rowStatsUpdate(int at)
+{
+    erow *row = &config.row[at];
+    int inWord = 0;
+    nesting nest = NESTING_INIT;
+    countNesting(row->chars, row->size, &nest);
+    statSetAt(config.statRoot, at, row->size + 1, countWords(row->chars, row->size, &inWord), nest.net, nest.low);
+}
+
 /**row operations**/
 
 
 int RowCxToRx(erow *row, int cx)
 {
+    if(config.columnMode) return columnCxToRx(row, cx);
     int rx = 0;
     int j;
     for(j = 0; j<cx; j++)
@@ -160,6 +998,8 @@ int RowRxToCx(erow *row, int rx) {
 }
 
 void updateRow(erow *row) {
+    forgetFields(row);
+    forgetNest(row);
     int tabs = 0;
     int j;
     for (j = 0; j < row->size; j++)
@@ -189,38 +1029,92 @@ void updateRow(erow *row) {
     }
   row->render[idx] = '\0';
   row->rsize = idx;
+  int at = row - config.row;
+  if(config.columnMode && at >= config.colFrom && at < config.colTo) layoutRow(row); //Widths only grow here
+}
+//Reads len bytes at off from the opened file
+void readSpan(char *dst, int len, off_t off)
+{
+    int got = 0;
+    while(got < len)
+    {
+        ssize_t n = pread(config.srcFd, dst + got, len - got, off + got);
+        if(n <= 0) err("pread");
+        got += n;
+    }
 }
+
+/**
+ * @brief Reads the text of a row which is still only in the line index
+ *
+ * @param row
+ */
+void rowLoad(erow *row)
+{
+    if(row->chars) return;
+    row->chars = malloc(row->size + 1);
+    readSpan(row->chars, row->size, row->foff);
+    row->chars[row->size] = '\0';
+    updateRow(row);
+}
+
+erow *rowAt(int at)
+{
+    rowLoad(&config.row[at]);
+    return &config.row[at];
+}
+
+void growRows(int need)
+{
+    if(need <= config.rowCap) return;
+    int cap = config.rowCap ? config.rowCap : 64;
+    while(cap < need) cap *= 2;
+    config.row = realloc(config.row, sizeof(erow) * cap);
+    if(config.row == NULL) err("Row allocation problems");
+    config.rowCap = cap;
+}
+
 void insertRow(int pos, char *s, size_t len)
 {
     if(pos < 0 || pos > config.numrow) return;
-    config.row = realloc(config.row, sizeof(erow) * (config.numrow + 1));
+    growRows(config.numrow + 1);
     memmove(&config.row[pos + 1], &config.row[pos], sizeof(erow) * (config.numrow-pos));
-    //Adding one extra space for new row
-    config.row = realloc(config.row, (sizeof(erow)) * (config.numrow+1));
 
     //Inserting the row info at the appropriate index
     config.row[pos].size = len;
     config.row[pos].chars = malloc(len+1);
-    strncpy((config.row[pos].chars), s, len);
+    memcpy(config.row[pos].chars, s, len);
+    config.row[pos].chars[len] = '\0';
 
 
     config.row[pos].rsize = 0;
     config.row[pos].render = NULL;
+    config.row[pos].foff = 0;
+    config.row[pos].fields = NULL;
+    config.row[pos].nfields = -1;
+    config.row[pos].nest = NULL;
     updateRow(&config.row[pos]);
     config.numrow++;
+    int inWord = 0;
+    nesting nest = NESTING_INIT;
+    countNesting(s, len, &nest);
+    statInsert(pos, len + 1, countWords(s, len, &inWord), nest.net, nest.low);
     config.dirty++;
 
 }
 void rowDelete(erow *row, int pos)
 {
+    rowLoad(row);
     if(pos<0 || pos>=row->size) return; //Invalid position
     memmove(&row->chars[pos], &row->chars[pos + 1], row->size - pos);
     row->size--;
     updateRow(row);
+    rowStatsUpdate(row - config.row);
     config.dirty++;
 }
 void rowInsertChar(erow *row, int pos, int c)
 {
+    rowLoad(row);
     if(pos<0 || pos>row->size) pos = row->size;
     row->chars = realloc(row->chars, row->size + 2);
     //Shift the content one place right,eg H|ello becomes H_ello | is cursor
@@ -228,17 +1122,33 @@ void rowInsertChar(erow *row, int pos, int c)
     row->size++;
     row->chars[pos] = c;
     updateRow(row);
+    rowStatsUpdate(row - config.row);
     config.dirty++;
 }
 
 
 
-/**editor operations**/
+//Replaces the whole text of a row
+void rowSetText(erow *row, const char *s, int len)
+{
+    free(row->chars);
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->size = len;
+    updateRow(row);
+    rowStatsUpdate(row - config.row);
+    config.dirty++;
+}
+
+/**editor operations**/
 
 void freeRow(erow *row)
 {
     free(row->chars);
     free(row->render);
+    free(row->fields);
+    forgetNest(row);
 }
 void DelRow(int pos)
 {
@@ -246,15 +1156,19 @@ void DelRow(int pos)
     freeRow(&config.row[pos]); //freeing the current line
     memmove(&config.row[pos], &config.row[pos+1], sizeof(erow) * (config.numrow - pos -1));
     config.numrow--;
+    statErase(pos);
     config.dirty++;
 }
 
 void joinRows(erow *row, char *s, size_t len)
 {
+    rowLoad(row);
     row->chars = realloc(row->chars, row->size + len + 1);
-    strncpy(&row->chars[row->size], s, len);
+    memcpy(&row->chars[row->size], s, len);
     row->size += len;
+    row->chars[row->size] = '\0';
     updateRow(row);
+    rowStatsUpdate(row - config.row);
     config.dirty++;
 
 }
@@ -270,6 +1184,7 @@ void DelChar()
     }
     else
     {
+        rowLoad(row);
         config.cx = config.row[config.cy-1].size; //x becomes the size of prev line
         joinRows(&config.row[config.cy-1], row->chars, row->size);
         DelRow(config.cy);
@@ -278,6 +1193,7 @@ void DelChar()
 }
 void insertChar(int c)
 {
+    if(config.cy == config.numrow) indexRows(INT_MAX); //The end has to be known before appending
     if(config.cy == config.numrow)
     {
         insertRow(config.numrow, "", 0);
@@ -288,724 +1204,5362 @@ void insertChar(int c)
 
 void insertNewLine()
 {
+    if(config.cy == config.numrow) indexRows(INT_MAX);
     if(config.cx == 0) //cursor at beginning of line
     {
         insertRow(config.cy, "", 0);
     }
     else
     {
-        erow *row = &config.row[config.cy];  //ptr to current row
+        erow *row = rowAt(config.cy);  //ptr to current row
         insertRow(config.cy + 1, &row->chars[config.cx], row->size - config.cx); //inserted new row
         row = &config.row[config.cy];
         row->size = config.cx; //trimming the current row
         row->chars[row->size] = '\0'; //inserting null char
         updateRow(row);
+        rowStatsUpdate(config.cy);
     }
     config.cy++;
     config.cx = 0;
 }
-/**FILE I/O**/
+/**selection**/
 
-char *rowToString(int *buflen)
+/**
+ * @brief Gives the selection between the mark and the cursor in document order
+ *
+ * @return int 0 if there is no selection
+ */
+int getSelection(int *sy, int *sx, int *ey, int *ex)
 {
-    int totlen = 0; //Total length of the file
-    int j;
-    for(j = 0; j<config.numrow; j++)
+    if(!config.markSet) return 0;
+    int my = config.my < config.numrow ? config.my : config.numrow;
+    int mx = my < config.numrow ? config.mx : 0;
+    if(my < config.numrow && mx > config.row[my].size) mx = config.row[my].size;
+    if(my < config.cy || (my == config.cy && mx <= config.cx))
     {
-        totlen += config.row[j].size + 1; //extra space for \n
+        *sy = my; *sx = mx;
+        *ey = config.cy; *ex = config.cx;
     }
-    *buflen = totlen;
-    char *buf = malloc(totlen); //allocating one big chunk of memory
-    char *p = buf;
-    for (j = 0; j < config.numrow; j++) {
-        memcpy(p, config.row[j].chars, config.row[j].size);
-        p += config.row[j].size; //incrementing p to the end
-        *p = '\n'; //Adding newline at the end
-        p++;
+    else
+    {
+        *sy = config.cy; *sx = config.cx;
+        *ey = my; *ex = mx;
     }
-    return buf;
+    return 1;
 }
 
-void saveFile()
+/**
+ * @brief Counts the selection, whole rows come from the statistics tree
+ *
+ * @param lines
+ * @param bytes
+ * @param words
+ * @return int 0 if there is no selection
+ */
+int selectionStats(int *lines, long long *bytes, long long *words)
 {
-    if(config.filename == NULL)
+    int sy, sx, ey, ex;
+    if(!getSelection(&sy, &sx, &ey, &ex)) return 0;
+    *lines = ey - sy + 1;
+    *bytes = (statPrefix(ey, NULL) + ex) - (statPrefix(sy, NULL) + sx);
+    int inWord = 0;
+    if(sy == ey)
     {
-        config.filename = promptUser("Save as: %s (ESC to Cancel)", NULL);
-        if(config.filename == NULL)
-        {
-            setStatusMsg("Save Aborted");
-        }
+        *words = ex > sx ? countWords(rowAt(sy)->chars + sx, ex - sx, &inWord) : 0;
+        return 1;
+    }
+    long long before, after;
+    statPrefix(sy + 1, &before);
+    statPrefix(ey, &after);
+    *words = after - before;
+    erow *first = rowAt(sy);
+    *words += countWords(first->chars + sx, first->size - sx, &inWord);
+    inWord = 0;
+    if(ey < config.numrow) *words += countWords(rowAt(ey)->chars, ex, &inWord);
+    return 1;
+}
+
+//Render columns of a row covered by the selection
+int selectionCols(int at, int *from, int *to)
+{
+    int sy, sx, ey, ex;
+    if(!getSelection(&sy, &sx, &ey, &ex) || at < sy || at > ey) return 0;
+    erow *row = rowAt(at);
+    *from = at == sy ? RowCxToRx(row, sx) : 0;
+    *to = RowCxToRx(row, at == ey ? ex : row->size);
+    return *from < *to;
+}
+
+void toggleMark()
+{
+    if(config.markSet)
+    {
+        config.markSet = 0;
+        setStatusMsg("Mark cleared");
         return;
     }
-    int len;
-    char *buf = rowToString(&len);
-    //Permissions: user|group|other 06-rw 04-r 04-r ->0644
-    int fd = open(config.filename, O_RDWR | O_CREAT, 0644);
-    if(fd != -1)
+    config.markSet = 1;
+    config.mx = config.cx;
+    config.my = config.cy;
+    setStatusMsg("Mark set, selection statistics are in the status bar");
+}
+
+/**column mode**/
+
+//Bytes of field i of a row whose fields are known
+int fieldLen(erow *row, int i)
+{
+    int end = i + 1 < row->nfields ? row->fields[i + 1] - 1 : row->size;
+    return end - row->fields[i];
+}
+
+void addField(int **fields, int *n, int *cap, int start)
+{
+    if(*n == *cap)
     {
-        if(ftruncate(fd, len) != -1)
-        {
-            if(write(fd, buf, len) == len)
-            {
-                close(fd);
-                free(buf);
-                config.dirty = 0;
-                setStatusMsg("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+        *cap *= 2;
+        *fields = realloc(*fields, sizeof(int) * *cap);
     }
-    free(buf);
-    
-    setStatusMsg("Can't save. I/O error: %s", strerror(errno));
-    return;
+    (*fields)[(*n)++] = start;
 }
+
 /**
- * @brief This function opens the file
+ * @brief Finds where the fields of a row start, delimiters inside quotes are skipped
  *
- * @param filename
+ * @param row
+ * @return int number of fields
  */
-void editorOpen(char *filename)
+int scanFields(erow *row)
 {
-    FILE *fp = fopen(filename, "r");
-    if(!fp) err("fopen");
-    config.filename = strdup(filename);
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while((linelen = getline(&line, &linecap, fp)) != -1) //read till EOF
+    if(row->nfields >= 0) return row->nfields;
+    int cap = 8, n = 0, inQuote = 0, j = 0;
+    int *fields = malloc(sizeof(int) * cap);
+    addField(&fields, &n, &cap, 0);
+#ifdef __SSE2__
+    //16 bytes at a time, only delimiters and quotes are looked at one by one
+    __m128i d = _mm_set1_epi8(config.delim), q = _mm_set1_epi8('"');
+    for(; j + 16 <= row->size; j += 16)
     {
-        while(linelen > 0 && (line[linelen-1] == '\r' || line[linelen-1] == '\n')) //trim /r/n
+        __m128i v = _mm_loadu_si128((const __m128i *)(row->chars + j));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, d), _mm_cmpeq_epi8(v, q)));
+        while(mask)
         {
-            linelen--;
+            int k = j + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if(row->chars[k] == '"') inQuote = !inQuote;
+            else if(!inQuote) addField(&fields, &n, &cap, k + 1);
         }
-        insertRow(config.numrow, line, linelen); //Insert the line in row struct
     }
-
-    free(line);
-    config.dirty = 0;
-    fclose(fp);
+#endif
+    for(; j<row->size; j++)
+    {
+        if(row->chars[j] == '"') inQuote = !inQuote;
+        else if(row->chars[j] == config.delim && !inQuote) addField(&fields, &n, &cap, j + 1);
+    }
+    row->fields = fields;
+    row->nfields = n;
+    return n;
 }
 
-/**FIND**/
-
-void findCallback(char *query, int key)
+//Drops the fields of a row about to change
+void forgetFields(erow *row)
 {
-    static int lastMatch = -1;
-    static int dirn = 1;
-
-    if(key == '\r' || key == '\x1b')
+    int at = row - config.row;
+    if(config.columnMode && row->nfields > 0 && at >= config.colFrom && at < config.colTo)
     {
-        //resetting values
-        lastMatch = -1; 
-        dirn = 1;
-        return;
+        for(int i = 0; i<row->nfields && i<config.colCount; i++)
+        {
+            if(fieldLen(row, i) >= config.colWidth[i])
+            {
+                config.colStale = 1; //The column may get narrower
+                break;
+            }
+        }
     }
-    else if(key == ARROW_DOWN || key == ARROW_RIGHT)
+    free(row->fields);
+    row->fields = NULL;
+    row->nfields = -1;
+}
+
+/**
+ * @brief Widens the columns to fit a row
+ *
+ * @param row
+ */
+void layoutRow(erow *row)
+{
+    int n = scanFields(row);
+    if(n > config.colCap)
     {
-        dirn = 1;
+        config.colCap = n * 2;
+        config.colWidth = realloc(config.colWidth, sizeof(int) * config.colCap);
+        config.colStart = realloc(config.colStart, sizeof(int) * (config.colCap + 1));
     }
-    else if(key == ARROW_LEFT || key == ARROW_UP)
+    int grown = 0;
+    for(int i = 0; i<n; i++)
     {
-        dirn = -1;
+        int w = fieldLen(row, i);
+        if(w > COLUMN_MAX) w = COLUMN_MAX;
+        if(w < 1) w = 1;
+        if(i >= config.colCount)
+        {
+            config.colWidth[i] = w;
+            grown = 1;
+        }
+        else if(w > config.colWidth[i])
+        {
+            config.colWidth[i] = w;
+            grown = 1;
+        }
     }
-    else
+    if(n > config.colCount) config.colCount = n;
+    if(!grown) return;
+    config.colStart[0] = 0;
+    for(int i = 0; i<config.colCount; i++) config.colStart[i + 1] = config.colStart[i] + config.colWidth[i] + COLUMN_SEP_LEN;
+}
+
+/**
+ * @brief Measures the columns on the rows around the screen when it moved away from them
+ *
+ */
+void measureColumns()
+{
+    int shown = rowAtScreen(visibleBefore(config.rowOff) + config.screenrows);
+    if(shown > config.numrow) shown = config.numrow;
+    if(!config.colStale && config.rowOff >= config.colFrom && shown <= config.colTo) return;
+    config.colFrom = config.rowOff - config.screenrows;
+    if(config.colFrom < 0) config.colFrom = 0;
+    config.colTo = shown + config.screenrows;
+    if(config.colTo > config.numrow) config.colTo = config.numrow;
+    config.colCount = 0;
+    config.colStale = 0;
+    for(int j = config.colFrom; j<config.colTo; j++) layoutRow(rowAt(j));
+}
+
+//Field of a row holding byte cx
+int fieldAt(erow *row, int cx)
+{
+    int lo = 0, hi = scanFields(row) - 1;
+    while(lo < hi)
     {
-        lastMatch = -1; 
-        dirn = 1;
+        int mid = lo + (hi - lo + 1) / 2;
+        if(row->fields[mid] <= cx) lo = mid;
+        else hi = mid - 1;
     }
-    if(lastMatch == -1) dirn = 1; //be default go fwd
-    int current = lastMatch;
-    int i;
-    for(i = 0; i<config.numrow; i++)
-    {
-        current += dirn;
+    return lo;
+}
 
-        //jmp to last row if too many back arrows
-        //basically wrap around
-        if(current == -1) current = config.numrow - 1;
-        else if(current == config.numrow) current = 0;
+int columnCxToRx(erow *row, int cx)
+{
+    layoutRow(row);
+    int k = fieldAt(row, cx);
+    int in = cx - row->fields[k];
+    if(in > config.colWidth[k]) in = config.colWidth[k];
+    return config.colStart[k] + in;
+}
 
-        erow *row = &config.row[current];
-        char *match = strstr(row->render, query);
-        if(match)
+/**
+ * @brief Lays a row out in columns for drawing
+ *
+ * @param row
+ * @param ab
+ */
+void renderColumns(erow *row, abuf *ab)
+{
+    layoutRow(row);
+    for(int i = 0; i<row->nfields; i++)
+    {
+        int w = config.colWidth[i];
+        int len = fieldLen(row, i);
+        int cut = len > w;
+        if(cut) len = w - 1;
+        char *f = &row->chars[row->fields[i]];
+        int from = ab->len;
+        abAppend(ab, f, len);
+        for(int j = from; j<ab->len; j++) if(iscntrl((unsigned char)ab->s[j])) ab->s[j] = ' ';
+        if(cut) abAppend(ab, ">", 1);
+        if(i + 1 < row->nfields)
         {
-            lastMatch = current;
-            config.cy = current;
-            config.cy = i; //Jump to that line
-            config.cx = RowRxToCx(row, match-row->render); //jump to that position in line
-            config.rowOff = config.numrow;
-            break;
+            for(; len + cut < w; len++) abAppend(ab, " ", 1);
+            abAppend(ab, COLUMN_SEP, COLUMN_SEP_LEN);
         }
     }
 }
-void findText()
+
+//Delimiter from the file name, else the most common candidate on the first rows
+char guessDelimiter()
 {
-    int origCx = config.cx;
-    int origCy = config.cy;
-    int origColOff = config.colOff;
-    int origRowOff = config.rowOff;
-    char *query = promptUser("Search: %s (ESC to cancel)", findCallback);
-    if(query)
+    char named = config.filename ? delimiterForName(config.filename) : 0;
+    if(named) return named;
+    const char *candidates = ",\t;|";
+    int best = ',', bestCount = 0;
+    for(const char *c = candidates; *c; c++)
     {
-        free(query);
+        int count = 0;
+        for(int j = 0; j<config.numrow && j<20; j++)
+        {
+            erow *row = rowAt(j);
+            for(int k = 0; k<row->size; k++) count += row->chars[k] == *c;
+        }
+        if(count > bestCount)
+        {
+            best = *c;
+            bestCount = count;
+        }
     }
-    else
+    return best;
+}
+
+void setColumnMode(int on)
+{
+    //Fields found with another delimiter are useless
+    for(int j = 0; j<config.numrow; j++)
     {
-        config.cx = origCx;
-        config.cy = origCy;
-        config.colOff = origColOff;
-        config.rowOff = origRowOff;     
+        free(config.row[j].fields);
+        config.row[j].fields = NULL;
+        config.row[j].nfields = -1;
     }
-    
+    config.columnMode = on;
+    config.colFrom = config.colTo = config.colCount = 0;
+    config.colOff = 0;
+    if(!on) return;
+    config.delim = guessDelimiter();
+    setStatusMsg("Columns split at %s", config.delim == '\t' ? "tabs" : (char[]){'\'', config.delim, '\'', 0});
 }
 
+//Ctrl-Left and Ctrl-Right go to the previous or next field
+void moveField(int key)
+{
+    if(!config.columnMode || config.cy >= config.numrow)
+    {
+        moveCursor(key == CTRL_LEFT ? ARROW_LEFT : ARROW_RIGHT);
+        return;
+    }
+    erow *row = rowAt(config.cy);
+    int k = fieldAt(row, config.cx);
+    if(key == CTRL_RIGHT && k + 1 < row->nfields) config.cx = row->fields[k + 1];
+    else if(key == CTRL_LEFT) config.cx = config.cx > row->fields[k] || k == 0 ? row->fields[k] : row->fields[k - 1];
+}
 
-/**Append Buffer**/
+/**folding**/
 
 /**
- * @brief This function appends the string to the buffer
+ * @brief Text of a row without loading it, valid until the next read
  *
- * @param ab
- * @param s
+ * Rows still in the file are served from a window read in INDEX_BLOCK pieces.
+ *
+ * @param rd
+ * @param at
  * @param len
+ * @return const char*
  */
-void abAppend(abuf *ab, const char *s, int len)
+const char *readRow(rowReader *rd, int at, int *len)
 {
-    char *new = realloc(ab->s, ab->len+len); // allocating space for increasing size of string
-    if(new == NULL) err("Buffer Allocation problems");
-    //Can't use string function because they add 0 at the end
-    memcpy(new + ab->len, s, len); //Copy string s at the end
-    ab->s = new;
-    ab->len += len;
-
+    erow *row = &config.row[at];
+    *len = row->size;
+    if(row->chars) return row->chars;
+    if(row->size > INDEX_BLOCK) return rowAt(at)->chars;
+    if(rd->buf == NULL || row->foff < rd->off || row->foff + row->size > rd->off + rd->len)
+    {
+        if(rd->buf == NULL) rd->buf = malloc(INDEX_BLOCK);
+        off_t left = config.srcSize - row->foff;
+        rd->len = left < INDEX_BLOCK ? left : INDEX_BLOCK;
+        rd->off = row->foff;
+        readSpan(rd->buf, rd->len, rd->off);
+    }
+    return rd->buf + (row->foff - rd->off);
 }
 
-/**
- * @brief This function frees the buffer
- *
- * @param ab
- */
-void abFree(abuf *ab)
+//Columns of leading white space, -1 for a blank row
+int rowIndent(rowReader *rd, int at)
 {
-    free(ab->s);
+    int len;
+    const char *s = readRow(rd, at, &len);
+    int ind = 0;
+    for(int j = 0; j<len; j++)
+    {
+        if(s[j] == '\t') ind += TABSIZE - ind % TABSIZE;
+        else if(s[j] == ' ') ind++;
+        else if(s[j] != '\r') return ind;
+    }
+    return -1;
 }
 
-/**----input----**/
-
 /**
- * @brief This function reads the keypress
+ * @brief Finds the rows a fold starting at row h would hide
  *
- * @return int
+ * A row ending in an opening bracket folds up to the row of the matching
+ * bracket, other rows fold the rows indented deeper than them.
+ *
+ * @param h
+ * @return int end of the fold, h + 1 if there is nothing to fold
  */
-int readKey()
+int foldEnd(int h)
 {
-    int nread;
-    char c;
-     while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    rowReader rd = READER_INIT;
+    int len;
+    const char *s = readRow(&rd, h, &len);
+    while(len > 0 && isspace((unsigned char)s[len-1])) len--;
+    int end = h + 1;
+    rowNest *ns = len > 0 && strchr("{[(", s[len-1]) ? nestOf(h) : NULL;
+    if(ns && ns->n && ns->b[ns->n-1].at == len - 1) //Not a bracket inside quotes
     {
-        if (nread == -1 && errno != EAGAIN) err("read");
+        //The block opened last, a row like } else { closes one first
+        int y, x;
+        end = blockEnd(h, len, &y, &x) == -1 ? config.numrow : y; //The closing row stays visible
+        if(end < h + 1) end = h + 1;
     }
-    if(c == '\x1b')
+    else
     {
-        //If escape sequence is detected then read two more bytes
-        //Page down and up 4 bytes. esc[5~ esc[6~
-        //Arrow keys 3 bytes esc[A esc[B esc[C esc[D
-        char seq[3];
-        if(read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if(read(STDIN_FILENO, &seq[1] , 1) != 1) return '\x1b';
-        if(seq[0] == '[')
+        int ind = rowIndent(&rd, h);
+        for(int j = h + 1; j<config.numrow || isIndexing(); j++)
         {
-            if(seq[1] >= '0' && seq[1] <= '9')
-            {
-                if(read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                //If third byte not there return esc
-                if(seq[2] == '~') //Page up and down ends etc etc with ~
-                {
-                    switch(seq[1])
-                    {
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '1':
-                        case '7': return HOME;
-                        case '4':
-                        case '8': return END;
-                        case '3': return DEL;
-                    }
-                }
-
-            }
-            else
-            {
-                switch(seq[1])
-                {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME;
-                    case 'F': return END;
-                }
-            }
+            indexRows(j + 1);
+            if(j >= config.numrow) break;
+            int in = rowIndent(&rd, j);
+            if(in == -1) continue; //Blank rows go with the block if it goes on
+            if(in <= ind || ind == -1) break;
+            end = j + 1;
         }
-        return '\x1b';
-    }
-    else
-    {
-        return (int)c;
     }
+    free(rd.buf);
+    return end;
 }
 
+//Shows the hidden rows right after row h
+int unfoldAt(int h)
+{
+    int end = rowAtScreen(visibleBefore(h + 1));
+    if(end > config.numrow) end = config.numrow;
+    if(end <= h + 1) return 0;
+    statSetHidden(h + 1, end, 0);
+    return end - h - 1;
+}
 
-char *promptUser(char *prompt, void(*callback)(char *, int))
+//Shows the fold holding a hidden row
+void revealRow(int at)
 {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize); //Stores user input
-    size_t buflen = 0;
-    buf[0] = 0;
+    if(at < config.numrow && isHidden(at)) unfoldAt(rowAtScreen(visibleBefore(at) - 1));
+}
 
-    while(1)
+//Keeps the cursor on a shown row after rows were hidden
+void cursorToShown()
+{
+    if(config.cy < config.numrow && isHidden(config.cy))
     {
-        setStatusMsg(prompt, buf);
-        refreshScreen();
-        int c = readKey();
-        if(c == DEL || c == CTRL('h') || c == BACKSPACE)
-        {
-            if(buflen != 0) buf[--buflen] = 0; //Inserting NULL at the position before
-        }
-        else if(c == '\r') //if enter is pressed
+        config.cy = rowAtScreen(visibleBefore(config.cy) - 1);
+        config.cx = 0;
+    }
+    if(config.rowOff < config.numrow && isHidden(config.rowOff)) config.rowOff = rowAtScreen(visibleBefore(config.rowOff) - 1);
+}
+
+//Ctrl-K folds the block under the cursor row or unfolds it
+void toggleFold()
+{
+    int h = config.cy;
+    if(h >= config.numrow) return;
+    int shown = unfoldAt(h);
+    if(shown)
+    {
+        setStatusMsg("Unfolded %d lines", shown);
+        return;
+    }
+    int end = foldEnd(h);
+    if(end <= h + 1)
+    {
+        setStatusMsg("Nothing to fold");
+        return;
+    }
+    statSetHidden(h + 1, end, 1);
+    setStatusMsg("Folded %d lines", end - h - 1);
+}
+
+/**
+ * @brief Ctrl-U folds every block at the indentation of the cursor row, or unfolds all
+ *
+ */
+void toggleFoldAll()
+{
+    statNode *root = &config.stat[config.statRoot];
+    if(root->visible < root->count)
+    {
+        statApply(config.statRoot, 0); //Tags the root, children follow lazily
+        setStatusMsg("Unfolded all");
+        return;
+    }
+    indexRows(INT_MAX);
+    rowReader rd = READER_INIT;
+    int level = config.cy < config.numrow ? rowIndent(&rd, config.cy) : 0;
+    if(level < 0) level = 0;
+    int h = -1, last = -1, folds = 0;
+    for(int j = 0; j<=config.numrow; j++)
+    {
+        int in = j < config.numrow ? rowIndent(&rd, j) : 0;
+        if(in == -1) continue;
+        if(h != -1 && in > level)
+        {
+            last = j;
+            continue;
+        }
+        if(h != -1 && last > h)
+        {
+            statSetHidden(h + 1, last + 1, 1);
+            folds++;
+        }
+        h = in == level ? j : -1;
+        last = j;
+    }
+    free(rd.buf);
+    cursorToShown();
+    setStatusMsg("Folded %d blocks", folds);
+}
+
+/**brackets**/
+
+int isOpening(char c)
+{
+    return c == '(' || c == '[' || c == '{';
+}
+
+//Drops the brackets of a row about to change
+void forgetNest(erow *row)
+{
+    if(row->nest == NULL) return;
+    free(row->nest->b);
+    free(row->nest->loose);
+    free(row->nest);
+    row->nest = NULL;
+}
+
+/**
+ * @brief Finds the brackets of a row and pairs the ones matched in the row
+ *
+ * @param at
+ * @return rowNest* kept until the row changes
+ */
+rowNest *nestOf(int at)
+{
+    erow *row = rowAt(at);
+    if(row->nest) return row->nest;
+    rowNest *ns = malloc(sizeof(rowNest));
+    int cap = 16, top = 0;
+    ns->b = malloc(sizeof(bracket) * cap);
+    ns->n = 0;
+    int *stack = malloc(sizeof(int) * cap); //Opening brackets not closed yet
+    nesting st = NESTING_INIT;
+    for(int j = 0; j<row->size; j += 64)
+    {
+        unsigned long long close, open = nestBits(row->chars + j, row->size - j < 64 ? row->size - j : 64, &st, &close);
+        unsigned long long all = open | close;
+        while(all)
+        {
+            unsigned long long bit = all & -all;
+            all ^= bit;
+            if(ns->n == cap)
+            {
+                cap *= 2;
+                ns->b = realloc(ns->b, sizeof(bracket) * cap);
+                stack = realloc(stack, sizeof(int) * cap);
+            }
+            bracket *b = &ns->b[ns->n];
+            b->at = j + __builtin_ctzll(bit);
+            b->depth = st.net;
+            b->pair = -1;
+            if(open & bit)
+            {
+                st.net++;
+                stack[top++] = ns->n;
+            }
+            else
+            {
+                if(--st.net < st.low) st.low = st.net;
+                if(top)
+                {
+                    b->pair = stack[--top];
+                    ns->b[b->pair].pair = ns->n;
+                }
+            }
+            b->up = top ? stack[top-1] : -1;
+            ns->n++;
+        }
+    }
+    free(stack);
+    ns->net = st.net;
+    ns->low = st.low;
+    ns->closing = -st.low;
+    //Closing brackets matched in other rows all come before the opening ones
+    ns->loose = malloc(sizeof(int) * (ns->closing + top + 1));
+    int k = 0;
+    for(int i = 0; i<ns->n; i++)
+    {
+        if(ns->b[i].pair == -1) ns->loose[k++] = i;
+    }
+    row->nest = ns;
+    return ns;
+}
+
+//First bracket of a row at or after column cx
+int nestIndex(rowNest *ns, int cx)
+{
+    int lo = 0, hi = ns->n;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(ns->b[mid].at < cx) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//Nesting right before column cx of a row
+long long depthAt(int at, int cx)
+{
+    if(at >= config.numrow) return nestBefore(config.numrow);
+    rowNest *ns = nestOf(at);
+    int i = nestIndex(ns, cx);
+    return nestBefore(at) + (i < ns->n ? ns->b[i].depth : ns->net);
+}
+
+//First row after at where the nesting falls to target, more of the file is indexed as needed
+int dropAfter(int at, long long target)
+{
+    int from = at + 1;
+    for(;;)
+    {
+        int found = statDrop(config.statRoot, 0, 0, from, config.numrow, target, 0);
+        if(found != -1 || !isIndexing()) return found;
+        if(config.numrow > from) from = config.numrow;
+        indexTo(config.scanOff + INDEX_CHUNK);
+    }
+}
+
+/**
+ * @brief Finds the opening bracket of the block around column cx of a row
+ *
+ * @param at
+ * @param cx
+ * @param y set to the row of the bracket
+ * @param x set to its column
+ * @return int -1 if cx is not inside brackets
+ */
+int blockStart(int at, int cx, int *y, int *x)
+{
+    rowNest *ns = nestOf(at);
+    int i = nestIndex(ns, cx);
+    int up = i > 0 ? ns->b[i-1].up : -1;
+    if(up != -1)
+    {
+        *y = at;
+        *x = ns->b[up].at;
+        return 0;
+    }
+    //The last row before which reaches the nesting outside the block holds it
+    long long target = depthAt(at, cx) - 1;
+    int row = statDrop(config.statRoot, 0, 0, 0, at, target, 1);
+    if(row == -1) return -1;
+    ns = nestOf(row);
+    int k = ns->closing + (int)(target - nestBefore(row) - ns->low);
+    *y = row;
+    *x = ns->b[ns->loose[k]].at;
+    return 0;
+}
+
+//Finds the closing bracket of the block around column cx of a row, like blockStart
+int blockEnd(int at, int cx, int *y, int *x)
+{
+    rowNest *ns = nestOf(at);
+    int i = nestIndex(ns, cx);
+    int up = i > 0 ? ns->b[i-1].up : -1;
+    if(up != -1 && ns->b[up].pair != -1)
+    {
+        *y = at;
+        *x = ns->b[ns->b[up].pair].at;
+        return 0;
+    }
+    //The first row which reaches the nesting outside the block holds it
+    long long target = depthAt(at, cx) - 1;
+    int row = at;
+    long long k = nestBefore(at) - target - 1;
+    if(k < 0 || k >= ns->closing || ns->b[ns->loose[k]].at < cx)
+    {
+        row = dropAfter(at, target);
+        if(row == -1) return -1;
+        ns = nestOf(row);
+        k = nestBefore(row) - target - 1;
+    }
+    *y = row;
+    *x = ns->b[ns->loose[k]].at;
+    return 0;
+}
+
+/**
+ * @brief Jumps to the bracket matching the one under the cursor, or to the start
+ * of the block around the cursor when it is not on a bracket
+ */
+void jumpToMatch()
+{
+    if(config.cy >= config.numrow) return;
+    rowNest *ns = nestOf(config.cy);
+    int i = nestIndex(ns, config.cx);
+    int y, x;
+    int found;
+    int onBracket = i < ns->n && ns->b[i].at == config.cx;
+    if(!onBracket) found = blockStart(config.cy, config.cx, &y, &x);
+    else if(ns->b[i].pair != -1)
+    {
+        y = config.cy;
+        x = ns->b[ns->b[i].pair].at;
+        found = 0;
+    }
+    else if(isOpening(config.row[config.cy].chars[config.cx])) found = blockEnd(config.cy, config.cx + 1, &y, &x);
+    else found = blockStart(config.cy, config.cx, &y, &x);
+    if(found == -1)
+    {
+        setStatusMsg("No matching bracket");
+        return;
+    }
+    if(onBracket)
+    {
+        char from = config.row[config.cy].chars[config.cx];
+        char to = rowAt(y)->chars[x];
+        char open = isOpening(from) ? from : to, close = isOpening(from) ? to : from;
+        if(close != (open == '(' ? ')' : open + 2)) setStatusMsg("Brackets %c and %c do not match", open, close);
+    }
+    jumpTo(y, x);
+}
+
+//Selects the block around the selection or the cursor, again to select the one around it
+void selectBlock()
+{
+    int sy = config.cy, sx = config.cx, ey, ex;
+    if(getSelection(&sy, &sx, &ey, &ex) == 0)
+    {
+        sy = config.cy;
+        sx = config.cx;
+    }
+    if(sy >= config.numrow) return;
+    int y0, x0, y1, x1;
+    if(blockStart(sy, sx, &y0, &x0) == -1 || blockEnd(sy, sx, &y1, &x1) == -1)
+    {
+        setStatusMsg("Not inside brackets");
+        return;
+    }
+    config.markSet = 1;
+    config.my = y0;
+    config.mx = x0;
+    jumpTo(y1, x1 + 1);
+}
+
+/**multiple cursors**/
+
+int cursorCmp(const void *a, const void *b)
+{
+    const cursor *p = a, *q = b;
+    if(p->y != q->y) return p->y < q->y ? -1 : 1;
+    return (p->x > q->x) - (p->x < q->x);
+}
+
+void addCursor(int x, int y)
+{
+    if(config.ncursors == config.cursorCap)
+    {
+        config.cursorCap = config.cursorCap ? config.cursorCap * 2 : 64;
+        config.cursors = realloc(config.cursors, sizeof(cursor) * config.cursorCap);
+        if(config.cursors == NULL) err("Cursor allocation problems");
+    }
+    config.cursors[config.ncursors++] = (cursor){x, y, 0};
+}
+
+void clearCursors()
+{
+    config.ncursors = 0;
+}
+
+//Sorts the cursors and drops the ones which landed on the same place
+void tidyCursors()
+{
+    qsort(config.cursors, config.ncursors, sizeof(cursor), cursorCmp);
+    int n = 0;
+    for(int j = 0; j<config.ncursors; j++)
+    {
+        cursor *c = &config.cursors[j];
+        if(c->x == config.cx && c->y == config.cy) continue;
+        if(n && c->x == config.cursors[n-1].x && c->y == config.cursors[n-1].y) continue;
+        config.cursors[n++] = *c;
+    }
+    config.ncursors = n;
+}
+
+//First extra cursor on row y or after it
+int firstCursor(int y)
+{
+    int lo = 0, hi = config.ncursors;
+    while(lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if(config.cursors[mid].y < y) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief Ctrl-A puts a cursor on every selected row, or at every match of a prompted text
+ *
+ */
+void addCursors()
+{
+    clearCursors();
+    int sy, sx, ey, ex;
+    if(getSelection(&sy, &sx, &ey, &ex))
+    {
+        //One cursor per row at the column of the main cursor
+        for(int j = sy; j<=ey && j<config.numrow; j++)
+        {
+            if(j == config.cy) continue;
+            int size = rowAt(j)->size;
+            addCursor(config.cx < size ? config.cx : size, j);
+        }
+        config.markSet = 0;
+    }
+    else
+    {
+        char *query = promptHistory("Cursor at each: %s (ESC to cancel, Ctrl-P/N history)", NULL, &config.searchHistory);
+        if(query == NULL) return;
+        indexRows(INT_MAX);
+        int qlen = strlen(query), found = 0;
+        rowReader rd = READER_INIT;
+        for(int j = 0; j<config.numrow && qlen; j++)
+        {
+            int len;
+            const char *t = readRow(&rd, j, &len);
+            const char *at = t;
+            while((at = memmem(at, t + len - at, query, qlen)) != NULL)
+            {
+                if(!found++)
+                {
+                    config.cy = j;
+                    config.cx = at - t;
+                }
+                else addCursor(at - t, j);
+                at += qlen;
+            }
+        }
+        free(rd.buf);
+        free(query);
+        if(!found)
+        {
+            setStatusMsg("Not found");
+            return;
+        }
+    }
+    tidyCursors();
+    setStatusMsg("%d cursors, ESC drops them", config.ncursors + 1);
+}
+
+/**
+ * @brief Rebuilds a row with an edit made at each of its cursors
+ *
+ * @param y
+ * @param c cursors on the row in column order, moved to where the edit leaves them
+ * @param k
+ * @param key character to insert, BACKSPACE or DEL
+ */
+void editRow(int y, cursor *c, int k, int key)
+{
+    erow *row = rowAt(y);
+    char *s = malloc(row->size + k + 1);
+    int len = 0, from = 0;
+    for(int i = 0; i<k; i++)
+    {
+        int x = c[i].x < row->size ? c[i].x : row->size;
+        if(x < from) x = from; //Two cursors deleted the same character
+        memcpy(s + len, row->chars + from, x - from);
+        len += x - from;
+        from = x;
+        if(key == BACKSPACE)
+        {
+            if(len > (i ? c[i-1].x : 0)) len--; //Not past what the cursor before left
+        }
+        else if(key == DEL)
+        {
+            if(from < row->size) from++;
+        }
+        else s[len++] = key;
+        c[i].x = len;
+    }
+    memcpy(s + len, row->chars + from, row->size - from);
+    len += row->size - from;
+    rowSetText(row, s, len);
+    free(s);
+}
+
+/**
+ * @brief Applies a keystroke at every cursor, each row is rebuilt once
+ *
+ * Backspace at the start of a row and Delete at its end do nothing for
+ * cursors, joining rows would move the rows of the cursors below.
+ *
+ * @param key
+ */
+void editCursors(int key)
+{
+    //A cursor past the last row types into a new one, as a single cursor does
+    if(key != BACKSPACE && key != DEL)
+    {
+        int last = config.ncursors ? config.cursors[config.ncursors-1].y : -1;
+        if(config.cy == config.numrow || last == config.numrow) indexRows(INT_MAX); //The end has to be known before appending
+        if(config.cy == config.numrow || last == config.numrow) insertRow(config.numrow, "", 0);
+    }
+    int n = config.ncursors + 1;
+    addCursor(config.cx, config.cy);
+    config.cursors[n-1].main = 1;
+    //Only the main cursor is out of place
+    cursor last = config.cursors[n-1];
+    int at = firstCursor(last.y);
+    while(at < n - 1 && cursorCmp(&config.cursors[at], &last) < 0) at++;
+    memmove(&config.cursors[at + 1], &config.cursors[at], sizeof(cursor) * (n - 1 - at));
+    config.cursors[at] = last;
+
+    for(int i = 0; i<n; )
+    {
+        int j = i;
+        while(j < n && config.cursors[j].y == config.cursors[i].y) j++;
+        if(config.cursors[i].y < config.numrow) editRow(config.cursors[i].y, &config.cursors[i], j - i, key);
+        i = j;
+    }
+
+    //Take the main cursor out again, the order is kept
+    int m = 0;
+    for(int i = 0; i<n; i++)
+    {
+        if(config.cursors[i].main)
+        {
+            config.cx = config.cursors[i].x;
+            continue;
+        }
+        config.cursors[m++] = config.cursors[i];
+    }
+    config.ncursors = m;
+    tidyCursors();
+}
+
+//Moves the extra cursors along their rows, or up and down with the main one
+void moveCursors(int key)
+{
+    for(int j = 0; j<config.ncursors; j++)
+    {
+        cursor *c = &config.cursors[j];
+        if(key == ARROW_UP && c->y > 0) c->y = rowAtScreen(visibleBefore(c->y) - 1); //Folded rows are skipped
+        else if(key == ARROW_DOWN && c->y < config.numrow)
+        {
+            indexRows(c->y + 2);
+            c->y = rowAtScreen(visibleBefore(c->y) + 1);
+            if(c->y > config.numrow) c->y = config.numrow;
+        }
+        int size = c->y < config.numrow ? rowAt(c->y)->size : 0;
+        if(key == ARROW_LEFT && c->x > 0) c->x--;
+        else if(key == ARROW_RIGHT && c->x < size) c->x++;
+        else if(key == HOME) c->x = 0;
+        else if(key == END || c->x > size) c->x = size;
+    }
+    tidyCursors();
+}
+
+/**
+ * @brief Draws a row with its extra cursors in reverse video
+ *
+ * @param ab
+ * @param row
+ * @param k first cursor on the row
+ * @param r render text from the first shown column
+ * @param len shown length of r
+ * @return int cells drawn
+ */
+int drawCursors(abuf *ab, erow *row, int k, const char *r, int len)
+{
+    int y = row - config.row, at = 0;
+    for(; k<config.ncursors && config.cursors[k].y == y; k++)
+    {
+        int x = RowCxToRx(row, config.cursors[k].x) - config.colOff;
+        if(x < at || x >= config.screencols) continue;
+        abAppend(ab, r + at, x - at);
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, x < len ? r + x : " ", 1);
+        abAppend(ab, "\x1b[m", 3);
+        at = x + 1;
+    }
+    if(at < len)
+    {
+        abAppend(ab, r + at, len - at);
+        at = len;
+    }
+    return at;
+}
+
+/**hashing**/
+
+static const unsigned long long hashKeys[8] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0x85ebca77c2b2ae63ULL,
+    0x27d4eb2f165667c5ULL, 0xff51afd7ed558ccdULL, 0xc4ceb9fe1a85ec53ULL, 0x94d049bb133111ebULL,
+};
+
+unsigned long long hashMix(unsigned long long h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * @brief 64 bit hash of a byte string
+ *
+ * 64 byte stripes are folded into eight independent lanes, each adding the
+ * data and the product of the two halves of data ^ key. With SSE2 two lanes
+ * go through one register; the scalar loop gives the same result.
+ *
+ * @param s
+ * @param len
+ * @return unsigned long long
+ */
+unsigned long long hashBytes(const char *s, size_t len)
+{
+    unsigned long long acc[8];
+    memcpy(acc, hashKeys, sizeof(acc));
+    size_t stripes = len / 64;
+#ifdef __SSE2__
+    __m128i lane[4];
+    for(int j = 0; j<4; j++) lane[j] = _mm_loadu_si128((const __m128i *)&acc[2*j]);
+    for(size_t i = 0; i<stripes; i++)
+    {
+        for(int j = 0; j<4; j++)
+        {
+            __m128i d = _mm_loadu_si128((const __m128i *)(s + i*64 + j*16));
+            __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)&hashKeys[2*j]));
+            __m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(2, 3, 0, 1)));
+            lane[j] = _mm_add_epi64(lane[j], _mm_add_epi64(prod, d));
+        }
+    }
+    for(int j = 0; j<4; j++) _mm_storeu_si128((__m128i *)&acc[2*j], lane[j]);
+#else
+    for(size_t i = 0; i<stripes; i++)
+    {
+        for(int j = 0; j<8; j++)
+        {
+            unsigned long long d;
+            memcpy(&d, s + i*64 + j*8, 8);
+            unsigned long long dk = d ^ hashKeys[j];
+            acc[j] += (dk & 0xffffffffULL) * (dk >> 32) + d;
+        }
+    }
+#endif
+    unsigned long long h = len * 0x9e3779b97f4a7c15ULL;
+    for(int j = 0; j<8; j++) h = hashMix(h ^ acc[j]);
+    for(size_t i = stripes * 64; i<len; i++) h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+    return hashMix(h);
+}
+
+/**
+ * @brief Records the hashes of the blocks of the opened file in buf
+ *
+ * @param buf
+ * @param off offset of buf in the file, a multiple of HASH_BLOCK
+ * @param n
+ */
+void hashBlocks(const char *buf, off_t off, ssize_t n)
+{
+    int need = (off + n + HASH_BLOCK - 1) / HASH_BLOCK;
+    if(need > config.blockCap)
+    {
+        config.blockCap = need * 2;
+        config.blockHash = realloc(config.blockHash, sizeof(unsigned long long) * config.blockCap);
+    }
+    for(ssize_t j = 0; j<n; j += HASH_BLOCK)
+    {
+        ssize_t len = n - j < HASH_BLOCK ? n - j : HASH_BLOCK;
+        config.blockHash[(off + j) / HASH_BLOCK] = hashBytes(buf + j, len);
+    }
+    config.hashOff = off + n;
+}
+
+int isHashing()
+{
+    return config.srcFd != -1 && config.hashOff < config.srcSize;
+}
+
+//Hashes the opened file up to upto when indexing did not already do it
+void hashTo(off_t upto)
+{
+    static char block[INDEX_BLOCK];
+    while(isHashing() && config.hashOff < upto)
+    {
+        ssize_t n = pread(config.srcFd, block, sizeof(block), config.hashOff);
+        if(n <= 0) break;
+        hashBlocks(block, config.hashOff, n);
+    }
+}
+
+/**FILE I/O**/
+
+//Compressed formats are decoded and encoded by the external tool through a pipe
+typedef struct format
+{
+    const char *tool;
+    const char *ext;
+    const char *magic;
+    int magicLen;
+} format;
+
+static const format formats[] = {
+    {NULL, NULL, NULL, 0}, //plain text
+    {"gzip", ".gz", "\x1f\x8b", 2},
+    {"zstd", ".zst", "\x28\xb5\x2f\xfd", 4},
+};
+#define NFORMATS ((int)(sizeof(formats) / sizeof(formats[0])))
+
+int detectFormat(const char *head, int len)
+{
+    for(int j = 1; j<NFORMATS; j++)
+    {
+        if(len >= formats[j].magicLen && memcmp(head, formats[j].magic, formats[j].magicLen) == 0) return j;
+    }
+    return 0;
+}
+
+int formatForName(const char *filename)
+{
+    size_t flen = strlen(filename);
+    for(int j = 1; j<NFORMATS; j++)
+    {
+        size_t elen = strlen(formats[j].ext);
+        if(flen > elen && strcmp(filename + flen - elen, formats[j].ext) == 0) return j;
+    }
+    return 0;
+}
+
+//Delimited text, known by its extension
+typedef struct tableFormat
+{
+    const char *ext;
+    char delim;
+} tableFormat;
+
+static const tableFormat tableFormats[] = {
+    {".csv", ','},
+    {".tsv", '\t'},
+    {".tab", '\t'},
+};
+#define NTABLEFORMATS ((int)(sizeof(tableFormats) / sizeof(tableFormats[0])))
+
+//Delimiter the extension of filename stands for, 0 if none. A compression extension after it is skipped
+char delimiterForName(const char *filename)
+{
+    size_t flen = strlen(filename);
+    int fmt = formatForName(filename);
+    if(fmt) flen -= strlen(formats[fmt].ext);
+    for(int j = 0; j<NTABLEFORMATS; j++)
+    {
+        size_t elen = strlen(tableFormats[j].ext);
+        if(flen > elen && strncmp(filename + flen - elen, tableFormats[j].ext, elen) == 0) return tableFormats[j].delim;
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs the tool of a format with in and out as its stdin and stdout
+ *
+ * @param fmt
+ * @param decode
+ * @param in
+ * @param out
+ * @return pid_t
+ */
+pid_t spawnFilter(int fmt, int decode, int in, int out)
+{
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        if(null != -1) dup2(null, STDERR_FILENO); //Keep the tool from writing over the screen
+        const char *tool = formats[fmt].tool;
+        execlp(tool, tool, decode ? "-dcq" : "-cq", (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+int writeAll(int fd, const char *s, size_t len)
+{
+    while(len)
+    {
+        ssize_t n = write(fd, s, len);
+        if(n == -1)
+        {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes every row and its newline to fd
+ *
+ * Rows still in the file are copied from it without being loaded.
+ *
+ * @param fd
+ * @param len set to the bytes written
+ * @return int -1 on failure with errno set
+ */
+int writeRows(int fd, long long *len)
+{
+    static char buf[PIPE_BUF_SIZE];
+    rowReader rd = READER_INIT;
+    int used = 0;
+    int failed = 0;
+    *len = 0;
+    for(int j = 0; j<config.numrow && !failed; j++)
+    {
+        int size;
+        const char *s = readRow(&rd, j, &size);
+        if(used + size + 1 > (int)sizeof(buf))
+        {
+            failed = writeAll(fd, buf, used);
+            used = 0;
+        }
+        if(size + 1 > (int)sizeof(buf)) //Too long to buffer, write it as it is
+        {
+            failed = failed || writeAll(fd, s, size) || writeAll(fd, "\n", 1);
+        }
+        else
+        {
+            memcpy(buf + used, s, size);
+            used += size;
+            buf[used++] = '\n';
+        }
+        *len += size + 1;
+    }
+    if(!failed && used) failed = writeAll(fd, buf, used);
+    free(rd.buf);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Streams the rows through the compressor of fmt into fd
+ *
+ * @param fd
+ * @param fmt
+ * @param len uncompressed size
+ * @return int -1 on failure
+ */
+int saveCompressed(int fd, int fmt, long long *len)
+{
+    int pfd[2];
+    if(pipe2(pfd, O_CLOEXEC) == -1) return -1; //The tool must not hold our end open
+    pid_t pid = spawnFilter(fmt, 0, pfd[0], fd);
+    close(pfd[0]);
+    if(pid == -1)
+    {
+        close(pfd[1]);
+        return -1;
+    }
+    int failed = writeRows(pfd[1], len);
+    close(pfd[1]); //EOF lets the compressor finish
+    int status;
+    if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        if(!failed) errno = EIO;
+        failed = -1;
+    }
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Points rows at their place in the freshly saved file
+ *
+ * @param len size of the saved file
+ */
+void rebaseRows(off_t len)
+{
+    if(config.srcFd == -1) return;
+    int fd = open(config.filename, O_RDONLY); //Saving under a new name moves the source too
+    if(fd == -1)
+    {
+        for(int j = 0; j<config.numrow; j++) rowLoad(&config.row[j]);
+        releaseSource();
+        config.srcFd = -1;
+        return;
+    }
+    releaseSource();
+    config.srcFd = fd;
+    off_t off = 0;
+    for(int j = 0; j<config.numrow; j++)
+    {
+        config.row[j].foff = off; //Every row matches the file again
+        off += config.row[j].size + 1;
+    }
+    config.srcSize = config.scanOff = config.lineStart = len;
+    config.hashOff = 0; //The saved file is hashed again while idle
+}
+
+int isIndexing()
+{
+    return config.srcFd != -1 && config.scanOff < config.srcSize;
+}
+
+//Rows found by the last indexTo call, added to the statistics tree in one go
+static int *scanBytes, *scanWordsOf, *scanNetOf, *scanLowOf;
+static int scanRows, scanCap;
+
+void appendLazyRow(off_t foff, off_t len, int words, int net, int low)
+{
+    growRows(config.numrow + 1);
+    erow *row = &config.row[config.numrow++];
+    row->size = len;
+    row->chars = NULL; //Loaded from the file when it is first needed
+    row->rsize = 0;
+    row->render = NULL;
+    row->foff = foff;
+    row->fields = NULL;
+    row->nfields = -1;
+    row->nest = NULL;
+    if(scanRows == scanCap)
+    {
+        scanCap = scanCap ? scanCap * 2 : 4096;
+        scanBytes = realloc(scanBytes, sizeof(int) * scanCap);
+        scanWordsOf = realloc(scanWordsOf, sizeof(int) * scanCap);
+        scanNetOf = realloc(scanNetOf, sizeof(int) * scanCap);
+        scanLowOf = realloc(scanLowOf, sizeof(int) * scanCap);
+    }
+    scanBytes[scanRows] = len + 1;
+    scanNetOf[scanRows] = net;
+    scanLowOf[scanRows] = low;
+    scanWordsOf[scanRows++] = words;
+}
+
+/**
+ * @brief Scans the opened file for newlines until upto bytes are indexed
+ *
+ * @param upto
+ */
+void indexTo(off_t upto)
+{
+    static char block[INDEX_BLOCK];
+    scanRows = 0;
+    while(config.scanOff < config.srcSize && config.scanOff < upto)
+    {
+        ssize_t n = pread(config.srcFd, block, sizeof(block), config.scanOff);
+        if(n == -1) err("pread");
+        if(n == 0) //File got shorter under us
+        {
+            config.srcSize = config.scanOff;
+            break;
+        }
+        if(config.hashOff == config.scanOff) hashBlocks(block, config.scanOff, n); //Same read serves both
+        char *p = block;
+        char *nl;
+        while((nl = memchr(p, '\n', block + n - p)) != NULL)
+        {
+            off_t at = config.scanOff + (nl - block);
+            char before = nl > block ? nl[-1] : config.scanLast;
+            off_t len = at - config.lineStart;
+            if(len > 0 && before == '\r') len--; //trim /r/n
+            int words = config.scanWords + countWords(p, nl - p, &config.scanInWord);
+            countNesting(p, nl - p, &config.scanNest);
+            appendLazyRow(config.lineStart, len, words, config.scanNest.net, config.scanNest.low);
+            config.lineStart = at + 1;
+            config.scanWords = config.scanInWord = 0;
+            config.scanNest = (nesting)NESTING_INIT;
+            p = nl + 1;
+        }
+        config.scanWords += countWords(p, block + n - p, &config.scanInWord);
+        countNesting(p, block + n - p, &config.scanNest);
+        config.scanLast = block[n - 1];
+        config.scanOff += n;
+    }
+    if(config.scanOff == config.srcSize && config.lineStart < config.srcSize)
+    {
+        //Last line without a newline at the end
+        off_t len = config.srcSize - config.lineStart;
+        if(config.scanLast == '\r') len--;
+        appendLazyRow(config.lineStart, len, config.scanWords, config.scanNest.net, config.scanNest.low);
+        config.lineStart = config.srcSize;
+    }
+    if(scanRows) statAppend(statBuild(scanBytes, scanWordsOf, scanNetOf, scanLowOf, scanRows));
+}
+
+/**
+ * @brief Indexes the opened file until it has at least n rows or is fully indexed
+ *
+ * @param n
+ */
+void indexRows(int n)
+{
+    while(config.numrow < n && isIndexing())
+    {
+        indexTo(config.scanOff + INDEX_BLOCK);
+    }
+}
+
+/**
+ * @brief Returns the byte offset of a row in the document as it would be saved
+ *
+ * @param at row number, numrow gives the size of the document
+ * @return off_t
+ */
+off_t rowOffset(int at)
+{
+    return statPrefix(at, NULL);
+}
+
+//Size of the document including the part of the file which is not indexed yet
+off_t docSize()
+{
+    off_t size = rowOffset(config.numrow);
+    if(isIndexing()) size += config.srcSize - config.lineStart;
+    return size;
+}
+
+/**
+ * @brief Finds the row containing a byte offset of the document
+ *
+ * @param off
+ * @return int
+ */
+int rowAtByte(off_t off)
+{
+    while(isIndexing() && config.stat[config.statRoot].sumBytes <= off)
+    {
+        indexTo(config.scanOff + INDEX_BLOCK);
+    }
+    int at = statFind(off);
+    if(at >= config.numrow) at = config.numrow - 1;
+    return at < 0 ? 0 : at;
+}
+
+/**
+ * @brief Loads the rows [from, to), lines next to each other in the file are read together
+ *
+ * @param from
+ * @param to
+ */
+void loadRows(int from, int to)
+{
+    char *buf = NULL;
+    for(int j = from; j<to; j++)
+    {
+        if(config.row[j].chars) continue;
+        off_t start = config.row[j].foff;
+        off_t end = start + config.row[j].size;
+        int k = j + 1;
+        while(k < to && config.row[k].chars == NULL && config.row[k].foff > end && config.row[k].foff <= end + 2
+            && config.row[k].foff + config.row[k].size - start <= INDEX_BLOCK)
+        {
+            end = config.row[k].foff + config.row[k].size;
+            k++;
+        }
+        buf = realloc(buf, end - start + 1);
+        readSpan(buf, end - start, start);
+        for(; j<k; j++)
+        {
+            erow *row = &config.row[j];
+            row->chars = malloc(row->size + 1);
+            memcpy(row->chars, buf + (row->foff - start), row->size);
+            row->chars[row->size] = '\0';
+            updateRow(row);
+        }
+        j--;
+    }
+    free(buf);
+}
+
+/**
+ * @brief Creates a temporary file next to the file being saved
+ *
+ * @param target set to the path the temporary file replaces, with symlinks resolved
+ * @param tmp set to the name of the temporary file
+ * @return int fd, -1 on failure with errno set
+ */
+int openTemp(char *target, char *tmp)
+{
+    if(realpath(config.filename, target) == NULL) snprintf(target, PATH_MAX, "%s", config.filename);
+    if(snprintf(tmp, PATH_MAX, "%s.XXXXXX", target) >= PATH_MAX)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if(fd == -1) return -1;
+    //Permissions of the file it replaces, new files get user|group|other 06-rw 04-r 04-r ->0644
+    struct stat st;
+    fchmod(fd, stat(target, &st) == 0 ? st.st_mode & 07777 : 0644);
+    return fd;
+}
+
+/**
+ * @brief Puts a fully written temporary file in place of the saved one
+ *
+ * The old file stays whole until the rename, so a failed save loses nothing.
+ *
+ * @return int -1 on failure with errno set, the temporary file is removed
+ */
+int replaceWithTemp(int fd, const char *tmp, const char *target)
+{
+    struct stat st;
+    int failed = fsync(fd) == -1 || fstat(fd, &st) == -1;
+    if(close(fd) == -1) failed = 1;
+    if(!failed && rename(tmp, target) == -1) failed = 1;
+    if(failed)
+    {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    config.disk = st;
+    return 0;
+}
+
+/**
+ * @brief Writes the document to its file, in its compression format if it has one
+ *
+ * @param len bytes of text written
+ * @param stored bytes on disk, smaller than len for compressed files
+ * @return int -1 on failure with errno set
+ */
+int saveDocument(long long *len, long long *stored)
+{
+    int fmt = config.compress;
+    if(config.srcFd == -1 && fmt == 0) fmt = formatForName(config.filename); //New files follow their extension
+    if(fmt)
+    {
+        char target[PATH_MAX], tmp[PATH_MAX];
+        int fd = openTemp(target, tmp);
+        if(fd == -1) return -1;
+        if(saveCompressed(fd, fmt, len) == -1)
+        {
+            int saved = errno;
+            close(fd);
+            unlink(tmp);
+            errno = saved;
+            return -1;
+        }
+        if(replaceWithTemp(fd, tmp, target) == -1) return -1;
+        *stored = config.disk.st_size;
+        config.diskChanged = 0;
+        config.compress = fmt;
+        config.undo.dirty = config.undo.dirty == config.dirty ? 0 : -1; //Undo still applies to the saved text
+        config.dirty = 0;
+        return 0;
+    }
+    indexRows(INT_MAX); //the part which is not indexed yet is written too
+    char target[PATH_MAX], tmp[PATH_MAX];
+    int fd = openTemp(target, tmp);
+    if(fd == -1) return -1;
+    //Unloaded rows are copied from the old file, which stays open until the rename
+    if(writeRows(fd, len) == -1)
+    {
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    *stored = *len;
+    if(replaceWithTemp(fd, tmp, target) == -1) return -1;
+    config.diskChanged = 0;
+    rebaseRows(*len); //Rows point into the new file from now on
+    config.undo.dirty = config.undo.dirty == config.dirty ? 0 : -1;
+    config.dirty = 0;
+    return 0;
+}
+
+/**
+ * @brief Loads a file into the document
+ *
+ * Regular files are only scanned for newlines on demand, the text of a row is
+ * read when it is first displayed or edited.
+ *
+ * @param filename
+ * @return int -1 on failure with errno set
+ */
+int openDocument(char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) return -1;
+    struct stat st;
+    if(fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    config.filename = strdup(filename);
+    config.disk = st;
+    pid_t decoder = -1;
+    char head[4];
+    if(S_ISREG(st.st_mode) && (config.compress = detectFormat(head, pread(fd, head, sizeof(head), 0))))
+    {
+        //The decoder runs alongside us, lines are split as its output arrives
+        int pfd[2];
+        if(pipe2(pfd, O_CLOEXEC) == -1 || (decoder = spawnFilter(config.compress, 1, fd, pfd[1])) == -1) //The tool must not hold our end open
+        {
+            close(fd);
+            return -1;
+        }
+        close(pfd[1]);
+        close(fd);
+        fd = pfd[0];
+    }
+    else if(S_ISREG(st.st_mode))
+    {
+        config.srcFd = fd;
+        config.srcSize = st.st_size;
+        config.scanOff = config.lineStart = 0;
+        config.scanLast = 0;
+        config.dirty = 0;
+        return 0;
+    }
+
+    //Pipes, devices and decoder output can't be read at an offset, load them fully
+    FILE *fp = fdopen(fd, "r");
+    if(!fp)
+    {
+        close(fd);
+        return -1;
+    }
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while((linelen = getline(&line, &linecap, fp)) != -1) //read till EOF
+    {
+        while(linelen > 0 && (line[linelen-1] == '\r' || line[linelen-1] == '\n')) //trim /r/n
+        {
+            linelen--;
+        }
+        insertRow(config.numrow, line, linelen); //Insert the line in row struct
+    }
+
+    free(line);
+    config.dirty = 0;
+    fclose(fp);
+    if(decoder != -1)
+    {
+        int status;
+        if(waitpid(decoder, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees the document and leaves an empty one
+ *
+ */
+void closeDocument()
+{
+    dropUndo();
+    for(int j = 0; j<config.numrow; j++) freeRow(&config.row[j]);
+    free(config.row);
+    free(config.stat);
+    free(config.blockHash);
+    free(config.filename);
+    if(config.srcFd != -1) close(config.srcFd);
+    initDocument();
+}
+
+//Asks before a save overwrites a change someone else made to the file, 0 if the save is off
+int confirmOverwrite()
+{
+    if(!diskDiverged()) return 1;
+    setStatusMsg("File changed on disk since it was loaded. Overwrite? (y/n)");
+    refreshScreen();
+    int c = readKey();
+    if(c != 'y' && c != 'Y')
+    {
+        setStatusMsg("Save Aborted");
+        return 0;
+    }
+    return 1;
+}
+
+void saveFile()
+{
+    if(config.filename == NULL)
+    {
+        config.filename = promptUser("Save as: %s (ESC to Cancel)", NULL);
+        if(config.filename == NULL)
+        {
+            setStatusMsg("Save Aborted");
+        }
+        return;
+    }
+    if(!confirmOverwrite()) return;
+    long long len, stored;
+    if(saveDocument(&len, &stored) == -1)
+    {
+        setStatusMsg("Can't save. I/O error: %s", strerror(errno));
+    }
+    else if(config.compress)
+    {
+        setStatusMsg("%lld bytes written to disk (%s, %lld compressed)", len, formats[config.compress].tool, stored);
+    }
+    else
+    {
+        setStatusMsg("%lld bytes written to disk", len);
+    }
+}
+
+/**
+ * @brief This function opens the file
+ *
+ * A file which does not exist yet starts as an empty document, saving creates it.
+ *
+ * @param filename
+ * @return int 0 or -1 with errno set
+ */
+int editorOpen(char *filename)
+{
+    if(openDocument(filename) == -1)
+    {
+        if(errno != ENOENT) return -1;
+        config.filename = strdup(filename);
+        return 0;
+    }
+    loadSession();
+    //Files with NUL bytes near the start are shown in hex, which needs no line index
+    char head[4096];
+    ssize_t n = config.srcFd != -1 && !config.compress ? pread(config.srcFd, head, sizeof(head), 0) : 0;
+    if(n > 0 && memchr(head, 0, n))
+    {
+        hexOpen();
+        return 0;
+    }
+    indexRows(config.rowOff + config.screenrows + 1); //Enough to draw the first screen
+    if(delimiterForName(filename)) setColumnMode(1);
+    return 0;
+}
+
+/**FIND**/
+
+void findCallback(char *query, int key)
+{
+    static int lastMatch = -1;
+    static int dirn = 1;
+
+    if(key == '\r' || key == '\x1b')
+    {
+        //resetting values
+        lastMatch = -1; 
+        dirn = 1;
+        return;
+    }
+    else if(key == ARROW_DOWN || key == ARROW_RIGHT)
+    {
+        dirn = 1;
+    }
+    else if(key == ARROW_LEFT || key == ARROW_UP)
+    {
+        dirn = -1;
+    }
+    else
+    {
+        lastMatch = -1; 
+        dirn = 1;
+    }
+    if(lastMatch == -1) dirn = 1; //be default go fwd
+    int current = lastMatch;
+    int i;
+    for(i = 0; i<config.numrow; i++)
+    {
+        current += dirn;
+
+        //jmp to last row if too many back arrows
+        //basically wrap around
+        if(current == -1) current = config.numrow - 1;
+        else if(current == config.numrow) current = 0;
+
+        erow *row = rowAt(current);
+        char *match = strstr(row->render, query);
+        if(match)
+        {
+            lastMatch = current;
+            config.cy = current; //Jump to that line
+            config.cx = RowRxToCx(row, match-row->render); //jump to that position in line
+            config.rowOff = config.numrow;
+            break;
+        }
+    }
+}
+void findText()
+{
+    indexRows(INT_MAX); //Search wraps around so the whole file is needed
+    int origCx = config.cx;
+    int origCy = config.cy;
+    int origColOff = config.colOff;
+    int origRowOff = config.rowOff;
+    char *query = promptHistory("Search: %s (ESC to cancel, Ctrl-P/N history)", findCallback, &config.searchHistory);
+    if(query)
+    {
+        free(query);
+    }
+    else
+    {
+        config.cx = origCx;
+        config.cy = origCy;
+        config.colOff = origColOff;
+        config.rowOff = origRowOff;     
+    }
+    
+}
+
+
+/**hex view**/
+
+/**
+ * @brief Shows the opened file as bytes, straight from a private mapping
+ *
+ * Changed bytes only copy the pages they are on, the file is written when saved.
+ */
+void hexOpen()
+{
+    if(config.srcFd == -1 || config.compress)
+    {
+        setStatusMsg("Hex view needs a file on disk which is not compressed");
+        return;
+    }
+    if(config.dirty)
+    {
+        setStatusMsg("Save the changes before switching to the hex view");
+        return;
+    }
+    struct stat st;
+    if(fstat(config.srcFd, &st) == -1 || st.st_size == 0)
+    {
+        setStatusMsg("Nothing to show in hex");
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, config.srcFd, 0);
+    if(map == MAP_FAILED)
+    {
+        setStatusMsg("Can't map the file: %s", strerror(errno));
+        return;
+    }
+    config.hexMap = map;
+    config.hexSize = st.st_size;
+    config.hexPages = calloc((st.st_size / HEX_PAGE + 8) / 8, 1);
+    config.hexCursor = config.cy < config.numrow ? config.row[config.cy].foff + config.cx : 0;
+    if(config.hexCursor >= config.hexSize) config.hexCursor = config.hexSize - 1;
+    config.hexOff = config.hexCursor - config.hexCursor % HEX_ROW;
+    config.hexNibble = config.hexAscii = 0;
+    config.hexDirty = config.hexSaved = 0;
+    config.hexMode = 1;
+}
+
+void hexClose()
+{
+    if(config.hexDirty)
+    {
+        setStatusMsg("%d changed bytes, save them or press Ctrl-Q to drop them", config.hexDirty);
+        return;
+    }
+    off_t at = config.hexCursor;
+    munmap(config.hexMap, config.hexSize);
+    free(config.hexPages);
+    config.hexMap = NULL;
+    config.hexPages = NULL;
+    config.hexMode = 0;
+    if(config.hexSaved)
+    {
+        //Saved bytes may have been newlines, the line index starts again
+        char *filename = strdup(config.filename);
+        closeDocument();
+        if(openDocument(filename) == -1) err(filename);
+        free(filename);
+    }
+    int row = rowAtByte(at);
+    jumpTo(row, at - rowOffset(row));
+}
+
+//Writes the changed pages back into the file
+void hexSave()
+{
+    if(!confirmOverwrite()) return;
+    int fd = open(config.filename, O_WRONLY);
+    if(fd == -1)
+    {
+        setStatusMsg("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+    off_t pages = (config.hexSize + HEX_PAGE - 1) / HEX_PAGE;
+    long long written = 0;
+    for(off_t p = 0; p<pages; p++)
+    {
+        if(!(config.hexPages[p / 8] & (1 << (p % 8)))) continue;
+        off_t off = p * HEX_PAGE;
+        size_t len = config.hexSize - off < HEX_PAGE ? config.hexSize - off : HEX_PAGE;
+        while(len)
+        {
+            ssize_t n = pwrite(fd, config.hexMap + off, len, off);
+            if(n == -1)
+            {
+                setStatusMsg("Can't save! I/O error: %s", strerror(errno));
+                close(fd);
+                return;
+            }
+            off += n;
+            len -= n;
+            written += n;
+        }
+        config.hexPages[p / 8] &= ~(1 << (p % 8));
+    }
+    close(fd);
+    stat(config.filename, &config.disk); //Not a change made by someone else
+    setStatusMsg("%lld bytes written to disk", written);
+    config.hexSaved |= config.hexDirty > 0;
+    config.hexDirty = 0;
+}
+
+/**
+ * @brief Finds needle in hay, 16 places at a time
+ *
+ * Only places where both the first and the last byte of the needle match are
+ * compared in full.
+ *
+ * @return const unsigned char* NULL if not found
+ */
+const unsigned char *hexFind(const unsigned char *hay, size_t n, const unsigned char *needle, size_t m)
+{
+    if(m == 0 || m > n) return NULL;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[m-1]);
+    for(; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while(mask)
+        {
+            int k = __builtin_ctz(mask);
+            if(m <= 2 || memcmp(hay + i + k + 1, needle + 1, m - 2) == 0) return hay + i + k;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return memmem(hay + i, n - i, needle, m);
+}
+
+//Bytes of a pattern given as hex digits, else the text itself
+int hexPattern(const char *query, unsigned char *out)
+{
+    int digits = 0, len = 0;
+    for(const char *p = query; *p; p++)
+    {
+        if(isxdigit((unsigned char)*p)) digits++;
+        else if(*p != ' ') digits = -1;
+        if(digits < 0) break;
+    }
+    if(digits <= 0 || digits % 2)
+    {
+        len = strlen(query);
+        memcpy(out, query, len);
+        return len;
+    }
+    //Spaces may split a byte too, the digits are paired up once they are collected
+    digits = 0;
+    for(const char *p = query; *p; p++)
+    {
+        if(*p == ' ') continue;
+        int v = isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10;
+        if(digits++ % 2) out[len++] |= v;
+        else out[len] = v << 4;
+    }
+    return len;
+}
+
+//Ctrl-F in the hex view searches forward from the cursor and wraps around
+void hexSearch()
+{
+    char *query = promptHistory("Find bytes: %s (hex digits or text, ESC to cancel)", NULL, &config.searchHistory);
+    if(query == NULL) return;
+    unsigned char *needle = malloc(strlen(query) + 1);
+    int m = hexPattern(query, needle);
+    free(query);
+    off_t from = config.hexCursor + 1;
+    const unsigned char *hit = NULL;
+    if(from < config.hexSize) hit = hexFind(config.hexMap + from, config.hexSize - from, needle, m);
+    if(hit == NULL)
+    {
+        off_t upto = from + m - 1 < config.hexSize ? from + m - 1 : config.hexSize;
+        hit = hexFind(config.hexMap, upto, needle, m);
+    }
+    free(needle);
+    if(hit == NULL)
+    {
+        setStatusMsg("Not found");
+        return;
+    }
+    config.hexCursor = hit - config.hexMap;
+    config.hexNibble = 0;
+    config.hexOff = -1; //Put the match in the middle
+}
+
+//Ctrl-G in the hex view takes an offset: 0x hex, decimal or N%
+void hexGoto()
+{
+    char *query = promptUser("Offset: %s (0x hex, decimal or N%%, ESC to cancel)", NULL);
+    if(query == NULL) return;
+    char *end;
+    long long n = strtoll(query[0] == '@' ? query + 1 : query, &end, 0);
+    if(*end == '%' && end[1] == 0) n = (long double)config.hexSize * n / 100;
+    else if(*end != 0 || end == query)
+    {
+        setStatusMsg("Not an offset: %s", query);
+        free(query);
+        return;
+    }
+    free(query);
+    if(n < 0) n = 0;
+    if(n >= config.hexSize) n = config.hexSize - 1;
+    config.hexCursor = n;
+    config.hexNibble = 0;
+    config.hexOff = -1;
+}
+
+//Changes the byte under the cursor in the mapping, which copies just its page
+void hexPut(int value)
+{
+    config.hexMap[config.hexCursor] = value;
+    off_t p = config.hexCursor / HEX_PAGE;
+    config.hexPages[p / 8] |= 1 << (p % 8);
+    config.hexDirty++;
+}
+
+int hexDigit(int c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Handles a key in the hex view
+ *
+ * @param c
+ * @return int 0 if the key does the same as in the text view
+ */
+int hexKeyPress(int c)
+{
+    off_t page = (off_t)config.screenrows * HEX_ROW;
+    off_t to = config.hexCursor;
+    switch(c)
+    {
+        case ARROW_LEFT: to--; break;
+        case ARROW_RIGHT: to++; break;
+        case ARROW_UP: to -= HEX_ROW; break;
+        case ARROW_DOWN: to += HEX_ROW; break;
+        case PAGE_UP: to -= page; break;
+        case PAGE_DOWN: to += page; break;
+        case HOME: to -= to % HEX_ROW; break;
+        case END: to += HEX_ROW - 1 - to % HEX_ROW; break;
+        case DOC_HOME: to = 0; break;
+        case DOC_END: to = config.hexSize - 1; break;
+        case '\t':
+            config.hexAscii = !config.hexAscii;
+            config.hexNibble = 0;
+            return 1;
+        case CTRL('b'):
+            hexClose();
+            return 1;
+        case CTRL('s'):
+            hexSave();
+            return 1;
+        case CTRL('f'):
+            hexSearch();
+            return 1;
+        case CTRL('g'):
+            hexGoto();
+            return 1;
+        case CTRL('t'):
+            return 0;
+        default:
+            if(config.hexAscii && c >= ' ' && c < 127)
+            {
+                hexPut(c);
+                to++;
+            }
+            else if(!config.hexAscii && hexDigit(c) >= 0)
+            {
+                int b = config.hexMap[config.hexCursor];
+                if(config.hexNibble) b = (b & 0xf0) | hexDigit(c);
+                else b = (b & 0x0f) | hexDigit(c) << 4;
+                hexPut(b);
+                config.hexNibble = !config.hexNibble;
+                if(config.hexNibble) return 1;
+                to++;
+            }
+            break;
+    }
+    if(to < 0) to = 0;
+    if(to >= config.hexSize) to = config.hexSize - 1;
+    if(to != config.hexCursor) config.hexNibble = 0;
+    config.hexCursor = to;
+    return 1;
+}
+
+/**
+ * @brief Draws the shown rows of the hex view as offset, hex and text columns
+ *
+ * @param lines
+ * @param cy row of the cursor on screen
+ * @param cx column of the cursor on screen
+ */
+void hexDraw(abuf *lines, int *cy, int *cx)
+{
+    off_t page = (off_t)config.screenrows * HEX_ROW;
+    off_t row = config.hexCursor - config.hexCursor % HEX_ROW;
+    if(config.hexOff < 0) config.hexOff = row - (config.screenrows / 2) * HEX_ROW;
+    if(row < config.hexOff) config.hexOff = row;
+    if(row >= config.hexOff + page) config.hexOff = row - page + HEX_ROW;
+    if(config.hexOff < 0) config.hexOff = 0;
+    for(int y = 0; y<config.screenrows; y++)
+    {
+        off_t off = config.hexOff + (off_t)y * HEX_ROW;
+        if(off >= config.hexSize)
+        {
+            abAppend(&lines[y], "~", 1);
+            continue;
+        }
+        char line[128];
+        int len = snprintf(line, sizeof(line), "%010llx  ", (long long)off);
+        char text[HEX_ROW];
+        for(int k = 0; k<HEX_ROW; k++)
+        {
+            if(off + k < config.hexSize)
+            {
+                int b = config.hexMap[off + k];
+                len += snprintf(line + len, sizeof(line) - len, "%02x ", b);
+                text[k] = isprint(b) ? b : '.';
+            }
+            else
+            {
+                len += snprintf(line + len, sizeof(line) - len, "   ");
+                text[k] = ' ';
+            }
+            if(k == HEX_ROW / 2 - 1) line[len++] = ' ';
+        }
+        line[len++] = '|';
+        int textAt = len;
+        memcpy(line + len, text, HEX_ROW);
+        len += HEX_ROW;
+        line[len++] = '|';
+        if(len > config.screencols) len = config.screencols;
+        abuf *ab = &lines[y];
+        if(off == row)
+        {
+            //The column without the cursor shows its byte in reverse video
+            int k = config.hexCursor - off;
+            int hexAt = 12 + k * 3 + (k >= HEX_ROW / 2);
+            int mark = config.hexAscii ? hexAt : textAt + k;
+            int width = config.hexAscii ? 2 : 1;
+            *cy = y;
+            *cx = config.hexAscii ? textAt + k : hexAt + config.hexNibble;
+            if(mark + width <= len)
+            {
+                abAppend(ab, line, mark);
+                abAppend(ab, "\x1b[7m", 4);
+                abAppend(ab, line + mark, width);
+                abAppend(ab, "\x1b[m", 3);
+                abAppend(ab, line + mark + width, len - mark - width);
+                continue;
+            }
+        }
+        abAppend(ab, line, len);
+    }
+}
+
+/**Append Buffer**/
+
+/**
+ * @brief This function appends the string to the buffer
+ *
+ * @param ab
+ * @param s
+ * @param len
+ */
+void abAppend(abuf *ab, const char *s, int len)
+{
+    if(len == 0) return; //realloc to 0 bytes would free the buffer
+    char *new = realloc(ab->s, ab->len+len); // allocating space for increasing size of string
+    if(new == NULL) err("Buffer Allocation problems");
+    //Can't use string function because they add 0 at the end
+    memcpy(new + ab->len, s, len); //Copy string s at the end
+    ab->s = new;
+    ab->len += len;
+
+}
+
+/**
+ * @brief This function frees the buffer
+ *
+ * @param ab
+ */
+void abFree(abuf *ab)
+{
+    free(ab->s);
+}
+
+/**----input----**/
+
+/**
+ * @brief This function reads the keypress
+ *
+ * @return int
+ */
+int inputPending()
+{
+    if(config.replay || config.keyQueued) return 1; //Replays do no idle work, so they do not depend on timing
+    struct pollfd pfd = {config.inFd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+int parseKey()
+{
+    int nread;
+    char c;
+    //Keep indexing and hashing the opened file while the user is not typing, the hex view needs neither
+    while(!config.hexMode && (isIndexing() || isHashing()) && !inputPending())
+    {
+        if(isIndexing())
+        {
+            indexTo(config.scanOff + INDEX_CHUNK);
+            refreshScreen();
+        }
+        else hashTo(config.hashOff + INDEX_CHUNK);
+    }
+     while ((nread = readByte(&c, 1)) != 1)
+    {
+        if (nread == -1 && errno != EAGAIN) err("read");
+        if (nread == 0) checkDisk(); //read timed out, nothing typed for a while
+    }
+    return finishKey(c);
+}
+
+//Turns a byte read, and the escape sequence it may start, into a key
+int finishKey(char c)
+{
+    if(c == '\x1b')
+    {
+        //If escape sequence is detected then read two more bytes
+        //Page down and up 4 bytes. esc[5~ esc[6~
+        //Arrow keys 3 bytes esc[A esc[B esc[C esc[D
+        char seq[3];
+        if(readByte(&seq[0], 0) != 1) return '\x1b';
+        if(readByte(&seq[1], 0) != 1) return '\x1b';
+        if(seq[0] == '[')
+        {
+            if(seq[1] >= '0' && seq[1] <= '9')
+            {
+                if(readByte(&seq[2], 0) != 1) return '\x1b';
+                //If third byte not there return esc
+                if(seq[1] == '1' && seq[2] == ';')
+                {
+                    //Modified keys esc[1;5H is ctrl+home, esc[1;5F is ctrl+end, esc[1;5D and C ctrl+arrows
+                    char mod[2];
+                    if(readByte(&mod[0], 0) != 1) return '\x1b';
+                    if(readByte(&mod[1], 0) != 1) return '\x1b';
+                    if(mod[1] == 'H') return DOC_HOME;
+                    if(mod[1] == 'F') return DOC_END;
+                    if(mod[1] == 'D') return CTRL_LEFT;
+                    if(mod[1] == 'C') return CTRL_RIGHT;
+                }
+                if(seq[2] == '~') //Page up and down ends etc etc with ~
+                {
+                    switch(seq[1])
+                    {
+                        case '5': return PAGE_UP;
+                        case '6': return PAGE_DOWN;
+                        case '1':
+                        case '7': return HOME;
+                        case '4':
+                        case '8': return END;
+                        case '3': return DEL;
+                    }
+                }
+
+            }
+            else
+            {
+                switch(seq[1])
+                {
+                    case 'A': return ARROW_UP;
+                    case 'B': return ARROW_DOWN;
+                    case 'C': return ARROW_RIGHT;
+                    case 'D': return ARROW_LEFT;
+                    case 'H': return HOME;
+                    case 'F': return END;
+                }
+            }
+        }
+        return '\x1b';
+    }
+    else
+    {
+        return (int)c;
+    }
+}
+
+int readKey()
+{
+    int c;
+    if(config.keyQueued)
+    {
+        c = config.keyQueue[0];
+        memmove(config.keyQueue, config.keyQueue + 1, sizeof(int) * --config.keyQueued);
+    }
+    else c = parseKey();
+    if(config.replay) keyRead(c);
+    return c;
+}
+
+/**
+ * @brief Keeps a key typed while a command runs for later
+ *
+ * @param c
+ * @return int 1 if the key cancels the command instead
+ */
+int queueKey(int c)
+{
+    if(c == '\x1b' || c == CTRL('c'))
+    {
+        if(config.replay) keyRead(c);
+        return 1;
+    }
+    if(config.keyQueued == config.keyQueueCap)
+    {
+        config.keyQueueCap = config.keyQueueCap ? config.keyQueueCap * 2 : 16;
+        config.keyQueue = realloc(config.keyQueue, sizeof(int) * config.keyQueueCap);
+    }
+    config.keyQueue[config.keyQueued++] = c;
+    return 0;
+}
+
+
+void historyAdd(history *h, const char *s)
+{
+    if(h->len && strcmp(h->items[h->len-1], s) == 0) return;
+    if(h->len == HISTORY_MAX)
+    {
+        free(h->items[0]);
+        memmove(&h->items[0], &h->items[1], sizeof(char *) * (HISTORY_MAX - 1));
+        h->len--;
+    }
+    h->items[h->len++] = strdup(s);
+}
+
+char *promptUser(char *prompt, void(*callback)(char *, int))
+{
+    return promptHistory(prompt, callback, NULL);
+}
+
+/**
+ * @brief Prompts like promptUser, ctrl-p and ctrl-n step through h
+ *
+ * @param prompt
+ * @param callback
+ * @param h may be NULL
+ * @return char*
+ */
+char *promptHistory(char *prompt, void(*callback)(char *, int), history *h)
+{
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize); //Stores user input
+    size_t buflen = 0;
+    buf[0] = 0;
+    int recalled = h ? h->len : 0; //h->len is the empty line after the newest entry
+
+    while(1)
+    {
+        setStatusMsg(prompt, buf);
+        refreshScreen();
+        int c = readKey();
+        if(c == DEL || c == CTRL('h') || c == BACKSPACE)
+        {
+            if(buflen != 0) buf[--buflen] = 0; //Inserting NULL at the position before
+        }
+        else if(h && (c == CTRL('p') || c == CTRL('n')))
+        {
+            if(c == CTRL('p') && recalled > 0) recalled--;
+            else if(c == CTRL('n') && recalled < h->len) recalled++;
+            const char *item = recalled < h->len ? h->items[recalled] : "";
+            buflen = strlen(item);
+            if(buflen + 1 > bufsize)
+            {
+                bufsize = buflen + 1;
+                buf = realloc(buf, bufsize);
+            }
+            memcpy(buf, item, buflen + 1);
+        }
+        else if(c == '\r') //if enter is pressed
+        {
+            if(buflen != 0)
+            {
+                if(h) historyAdd(h, buf);
+                setStatusMsg("");
+                if (callback) callback(buf, c);
+                return buf;
+            }
+        }
+        else if(c == '\x1b') //Esc to cancel
+        {
+            setStatusMsg("");
+            if (callback) callback(buf, c);
+            free(buf);
+            return NULL;
+        }
+        else if(!iscntrl(c) && c<128)
+        {
+            if(buflen == bufsize -1)
+            {
+                bufsize = bufsize*2; //Increase buffer size when overflow
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = 0;
+        }
+        if (callback) callback(buf, c);
+    }
+}
+/**
+ * @brief This function moves the cursor
+ *
+ * @param key
+ */
+void moveCursor(int key)
+{
+    erow *row;
+    if(config.cy >= config.numrow)
+    {
+        row = NULL; //If cursor moves past end of file, row is null
+    }
+    else
+    {
+        row = &config.row[config.cy]; //else row points to the current line in the file
+    }
+    switch(key)
+    {
+        case ARROW_LEFT:
+            if(config.cx != 0) config.cx--;
+            else if(config.cy > 0)
+            {
+                //moving cursor to end of prev line
+                config.cy = rowAtScreen(visibleBefore(config.cy) - 1);
+                config.cx = config.row[config.cy].size;
+            }
+            break;
+        case ARROW_UP:
+            if(config.cy != 0) config.cy = rowAtScreen(visibleBefore(config.cy) - 1); //Folded rows are skipped
+            break;
+        case ARROW_DOWN:
+            indexRows(config.cy + 2); //Never reach the end of a file which is still indexing
+            if(config.cy < config.numrow) config.cy = rowAtScreen(visibleBefore(config.cy) + 1);
+            if(config.cy > config.numrow) config.cy = config.numrow;
+            break;
+        case ARROW_RIGHT:
+            if(row && config.cx < row->size)
+                config.cx++; //increment cx only till length of the current row
+            else if (row && config.cx == row->size)
+            {
+                indexRows(config.cy + 2);
+                config.cy = rowAtScreen(visibleBefore(config.cy) + 1);
+                if(config.cy > config.numrow) config.cy = config.numrow;
+                config.cx = 0;
+            }
+
+            break;
+    }
+
+    //Since after moving from a long line to
+    //a shorter line cx remains same as that of position in longer line we need to
+    //modify cx
+    row = (config.cy>=config.numrow) ? NULL:&config.row[config.cy];
+    int rowlen = row ? row->size: 0;
+    if(config.cx > rowlen) config.cx = rowlen;
+}
+
+/**
+ * @brief Moves the cursor to a row without walking through the rows in between
+ *
+ * @param at
+ */
+void moveToRow(int at)
+{
+    if(at < 0) at = 0;
+    indexRows(at + 1);
+    if(at > config.numrow) at = config.numrow;
+    config.cy = at;
+    int rowlen = at < config.numrow ? config.row[at].size : 0;
+    if(config.cx > rowlen) config.cx = rowlen;
+}
+
+//Jumps to a row and column and puts it in the middle of the screen
+void jumpTo(int at, int cx)
+{
+    config.cx = cx;
+    moveToRow(at);
+    revealRow(config.cy);
+    config.rowOff = rowAtScreen(visibleBefore(config.cy) - config.screenrows / 2);
+    if(config.rowOff > config.cy) config.rowOff = config.cy;
+}
+
+/**
+ * @brief Resolves a goto target: a line number, N%, @byte offset, ^ or $
+ *
+ * @param query
+ * @param at row of the target
+ * @param cx column of the target
+ * @return int -1 if query is not a target
+ */
+int parseTarget(const char *query, int *at, int *cx)
+{
+    char *end;
+    long long n = 0;
+    *cx = 0;
+    if(strcmp(query, "^") == 0)
+    {
+        *at = 0;
+    }
+    else if(strcmp(query, "$") == 0)
+    {
+        indexRows(INT_MAX);
+        *at = config.numrow - 1;
+    }
+    else if(query[0] == '@' && (n = strtoll(query + 1, &end, 0)) >= 0 && end != query + 1 && *end == 0)
+    {
+        *at = rowAtByte(n);
+        if(*at < config.numrow) *cx = n - rowOffset(*at);
+    }
+    else if(isdigit((unsigned char)query[0]) && (n = strtoll(query, &end, 10)) >= 0 && end != query)
+    {
+        if(strcmp(end, "%") == 0)
+        {
+            if(n > 100) n = 100;
+            *at = rowAtByte(docSize() * n / 100);
+        }
+        else if(*end == 0)
+        {
+            *at = n > INT_MAX ? INT_MAX : n - 1;
+        }
+        else return -1;
+    }
+    else return -1;
+    return 0;
+}
+
+/**
+ * @brief Asks for a line number, a percentage, a byte offset or ^ and $
+ *
+ */
+void gotoLine()
+{
+    char *query = promptUser("Goto: %s (line, N%%, @offset, ^ or $; ESC to cancel)", NULL);
+    if(query == NULL) return;
+    int at, cx;
+    if(parseTarget(query, &at, &cx) == 0)
+    {
+        jumpTo(at, cx);
+    }
+    else
+    {
+        setStatusMsg("Invalid goto target: %s", query);
+    }
+    free(query);
+}
+
+/**
+ * @brief This function processes the keypress
+ *
+ */
+void processKeyPress()
+{
+    static int quit_time = QUIT_TIME;
+    int c = readKey();
+    if(config.hexMode && c != CTRL('q') && hexKeyPress(c))
+    {
+        quit_time = QUIT_TIME;
+        return;
+    }
+    switch(c)
+    {
+        //present in ttydefaults already included
+        case CTRL('q'):
+            if((config.dirty || config.hexDirty) && quit_time>0 && !config.serving)
+            {
+                setStatusMsg("WARNING !! Unsaved changes. "
+                "Press ctrl-q %d more times.", quit_time);
+                quit_time--;
+                return;
+            }
+            //clear screen then exit
+            write(config.outFd, "\x1b[2J", 4);
+            write(config.outFd, "\x1b[H", 3);
+            if(config.serving)
+            {
+                config.clientGone = 1; //The document stays open for the next client
+                return;
+            }
+            saveSession();
+            exit(0);
+        case CTRL('s'):
+            saveFile();
+            break;
+        case HOME:
+            config.cx = 0;
+            moveCursors(c);
+            break;
+        case END:
+            if(config.cy<config.numrow) config.cx = config.row[config.cy].size;
+            moveCursors(c);
+            break;
+        case PAGE_UP:
+            moveToRow(rowAtScreen(visibleBefore(config.rowOff) - config.screenrows));
+            break;
+        case PAGE_DOWN:
+            moveToRow(rowAtScreen(visibleBefore(config.rowOff) + 2 * config.screenrows - 1));
+            break;
+        case DOC_HOME:
+            jumpTo(0, 0);
+            break;
+        case DOC_END:
+            indexRows(INT_MAX);
+            jumpTo(config.numrow - 1, INT_MAX);
+            break;
+        case CTRL('g'):
+            gotoLine();
+            break;
+        case CTRL('r'):
+            clearCursors();
+            reloadFile();
+            break;
+        case CTRL('b'):
+            hexOpen();
+            break;
+        case CTRL('e'):
+            setColumnMode(!config.columnMode);
+            break;
+        case CTRL('k'):
+            toggleFold();
+            break;
+        case CTRL('u'):
+            toggleFoldAll();
+            break;
+        case CTRL(']'):
+            jumpToMatch();
+            break;
+        case CTRL('\\'):
+            selectBlock();
+            break;
+        case CTRL('x'):
+            commandPrompt();
+            break;
+        case CTRL('z'):
+            undoRange();
+            break;
+        case CTRL_LEFT:
+        case CTRL_RIGHT:
+            moveField(c);
+            break;
+        case CTRL('t'):
+            config.showFrameStats = !config.showFrameStats;
+            break;
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+            moveCursor(c);
+            moveCursors(c);
+            break;
+        case '\r':
+            clearCursors(); //New rows would move the cursors below
+            insertNewLine();
+            break;
+        case BACKSPACE:
+        case CTRL('h'):
+        case DEL:
+            if(config.ncursors)
+            {
+                editCursors(c == DEL ? DEL : BACKSPACE);
+                break;
+            }
+            if(c == DEL) moveCursor(ARROW_RIGHT);
+            DelChar();
+            break;
+        case '\x1b':
+            config.markSet = 0;
+            clearCursors();
+            break;
+        case CTRL('a'):
+            addCursors();
+            break;
+        case 0: //ctrl+space
+            toggleMark();
+            break;
+        case CTRL('f'):
+            findText();
+            break;
+        default:
+            if(config.ncursors) editCursors(c);
+            else insertChar(c);
+            break;
+    }
+    quit_time = QUIT_TIME;
+}
+
+/**
+ * @brief This function gets the cursor position
+ *
+ * @param row
+ * @param col
+ * @return int
+ * */
+int getCursorPosition(unsigned short int *row, unsigned short int *col)
+{
+    *row = *col = 0;
+
+    //ESC [ Ps n Ps = 6 means Command from host – Please report active position (using a CPR control sequence)
+    if(write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+    char parse_buf[32] = {0};
+    //Now the terminal will return an escape sequence of form 27[r;cR r = row, c = col. we have to parse it
+    short int i = 0;
+    while(i<(short int)(sizeof(parse_buf)-1))
+    {
+        if(read(STDIN_FILENO, &parse_buf[i], 1) != 1) break;
+        if (parse_buf[i] == 'R') break;
+        i++;
+    }
+
+    //No idea why this loop is insanely slow
+    // while(parse_buf[i] != 'R')
+    // {
+    // 	if(read(STDIN_FILENO, &parse_buf[i], 1) != 1) break;
+    // 	i++;
+    // }
+    // printf("\r\n&buf[i]: %s\r\n", &parse_buf[1]);
+    if(parse_buf[0] != '\x1b' || parse_buf[1] != '[')
+    {
+        return -1;
+    }
+    if(sscanf(&parse_buf[2], "%hu;%hu", row, col) != 2)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**----output----**/
+
+
+int getWindowSize(unsigned short int *rows, unsigned short int *cols)
+{
+    struct winsize ws;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    {
+        if(write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+        {
+            return -1;
+        }
+        int k = getCursorPosition(rows, cols);
+        err("WTF");
+        return k;
+
+    }
+    else {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+
+
+}
+
+
+void scroll()
+{
+    revealRow(config.cy); //Jumps into a fold open it
+    cursorToShown();
+    if(config.cy<config.rowOff)
+    {
+        
+        config.rowOff = config.cy;
+    }
+    //Screen lines are counted in shown rows
+    int line = visibleBefore(config.cy);
+    if(line >= visibleBefore(config.rowOff) + config.screenrows)
+    {
+        config.rowOff = rowAtScreen(line - config.screenrows + 1);
+    }
+    if(config.columnMode) measureColumns(); //Before rx, which depends on the widths
+    config.rx = 0;
+    if(config.cy<config.numrow)
+    {
+        config.rx = RowCxToRx(rowAt(config.cy), config.cx);
+    }
+    if(config.columnMode && config.cy < config.numrow
+        && (config.rx < config.colOff || config.rx >= config.colOff + config.screencols))
+    {
+        //Scroll by whole columns, the one with the cursor goes to the left edge
+        int start = config.colStart[fieldAt(rowAt(config.cy), config.cx)];
+        if(config.rx < start + config.screencols) config.colOff = start;
+    }
+    if(config.rx < config.colOff)
+    {
+        config.colOff = config.rx;
+    }
+    if(config.rx >= config.colOff + config.screencols)
+    {
+        config.colOff = config.rx-config.screencols + 1;
+    }
+
+}
+/**
+ * @brief This function draws the rows of the editor
+ *
+ * @param ab
+ */
+void drawRows(abuf *lines)
+{
+    int top = visibleBefore(config.rowOff);
+    for(int y = 0; y<config.screenrows; y++)
+    {
+        abuf *ab = &lines[y];
+        int filerow = rowAtScreen(top + y);
+        if(filerow >= config.numrow)
+        {
+            if(y>=config.numrow)
+            {
+                if(config.numrow == 0 && y == config.screenrows/3)
+                {
+                    char welcomemsg[80] = {0};
+                    int msglen = snprintf(welcomemsg, sizeof(welcomemsg), "TextEditor Version %s", VER);
+                    if(msglen > config.screencols) msglen = config.screencols;
+                    int padding = (config.screencols - msglen) / 2;
+                    if (padding) {
+                    abAppend(ab, "~", 1);
+                    padding--;
+                    }
+                    while (padding--) abAppend(ab, " ", 1);
+                    abAppend(ab, welcomemsg, msglen);
+
+                }
+                else
+                {
+                    abAppend(ab, "~", 1);
+                }
+            }
+        }
+        else
+        {
+            erow *row = rowAt(filerow);
+            char *render = row->render;
+            int rsize = row->rsize;
+            abuf cols = ABUF_INIT;
+            if(config.columnMode)
+            {
+                renderColumns(row, &cols);
+                abAppend(&cols, "", 1); //Never empty
+                render = cols.s;
+                rsize = cols.len - 1;
+            }
+            int len = rsize - config.colOff;
+            if(len<0) len = 0;
+            if(len > config.screencols) len = config.screencols;
+            int from, to, k = firstCursor(filerow);
+            if(k < config.ncursors && config.cursors[k].y == filerow)
+            {
+                len = drawCursors(ab, row, k, &render[config.colOff < rsize ? config.colOff : rsize], len);
+            }
+            else if(selectionCols(filerow, &from, &to))
+            {
+                //Selected part in reverse video
+                from -= config.colOff;
+                to -= config.colOff;
+                if(from < 0) from = 0;
+                if(from > len) from = len;
+                if(to < from) to = from;
+                if(to > len) to = len;
+                char *r = &render[config.colOff < rsize ? config.colOff : rsize];
+                abAppend(ab, r, from);
+                abAppend(ab, "\x1b[7m", 4);
+                abAppend(ab, r + from, to - from);
+                abAppend(ab, "\x1b[m", 3);
+                abAppend(ab, r + to, len - to);
+            }
+            else if(len > 0)
+            {
+                abAppend(ab, &render[config.colOff], len);
+            }
+            free(cols.s);
+            if(filerow + 1 < config.numrow && isHidden(filerow + 1))
+            {
+                char fold[40];
+                int n = snprintf(fold, sizeof(fold), " ... %d lines", rowAtScreen(top + y + 1) - filerow - 1);
+                if(n > config.screencols - len) n = config.screencols - len;
+                if(n > 0)
+                {
+                    abAppend(ab, "\x1b[2m", 4);
+                    abAppend(ab, fold, n);
+                    abAppend(ab, "\x1b[m", 3);
+                }
+            }
+        }
+    }
+}
+
+void drawStatusBar(abuf *ab)
+{
+    abAppend(ab, "\x1b[7m", 4);
+    char status[160];
+    char lno[80]; //Shows line number
+
+    char indexing[24] = "";
+    if(isIndexing())
+    {
+        snprintf(indexing, sizeof(indexing), "+ (indexing %d%%)", (int)(config.scanOff * 100 / config.srcSize));
+    }
+    int len;
+    const char *name = config.filename ? config.filename : "[Untitled]";
+    const char *modified = config.dirty != 0 ? "(modified)" : "(Unmodified)";
+    long long selBytes, selWords;
+    int selLines;
+    if(config.hexMode)
+    {
+        len = snprintf(status, sizeof(status), "%.20s %s - hex, %lld bytes%s", name,
+            config.hexDirty ? "(modified)" : "(Unmodified)", (long long)config.hexSize, config.hexAscii ? ", typing text" : "");
+    }
+    else if(config.ncursors)
+    {
+        len = snprintf(status, sizeof(status), "%.20s %s - %d cursors", name, modified, config.ncursors + 1);
+    }
+    else if(selectionStats(&selLines, &selBytes, &selWords))
+    {
+        len = snprintf(status, sizeof(status), "%.20s %s - selected %d lines, %lld words, %lld bytes",
+            name, modified, selLines, selWords, selBytes);
+    }
+    else
+    {
+        //Totals are the sums at the root of the statistics tree
+        statNode *all = &config.stat[config.statRoot];
+        len = snprintf(status, sizeof(status), "%.20s %s - %d%s lines, %lld%s words, %lld bytes",
+            name, modified, config.numrow, indexing, all->sumWords, isIndexing() ? "+" : "",
+            (long long)docSize());
+    }
+    long long byte = config.hexMode ? config.hexCursor : rowOffset(config.cy) + config.cx;
+    char field[24] = "";
+    if(config.columnMode && config.cy < config.numrow)
+    {
+        snprintf(field, sizeof(field), ", Field %d", fieldAt(rowAt(config.cy), config.cx) + 1);
+    }
+    char depth[32] = "";
+    long long level = 0;
+    if(!config.hexMode && config.cy < config.numrow && (config.row[config.cy].nest || config.row[config.cy].size <= DEPTH_ROW_MAX))
+    {
+        level = depthAt(config.cy, config.cx); //Huge rows are not scanned again on every key
+    }
+    if(level) snprintf(depth, sizeof(depth), ", Depth %lld", level);
+    int rlen = config.hexMode ? snprintf(lno, sizeof(lno), "Offset 0x%llx, Byte %lld", byte, byte)
+        : snprintf(lno, sizeof(lno), "Ln %d, Col %d%s%s, Byte %lld", config.cy+1, config.cx + 1, field, depth, byte);
+    if(len > (int)sizeof(status) - 1) len = sizeof(status) - 1;
+    if(len > config.screencols - rlen - 1) len = config.screencols - rlen - 1; //Cursor position wins
+    if(len < 0) len = 0;
+    if(len > config.screencols) len = config.screencols;
+    abAppend(ab, status , len);
+    while(len<config.screencols)
+    {
+        if(config.screencols - len == rlen)
+        {
+            abAppend(ab, lno, rlen);
+            break;
+        }
+        else
+        {
+            abAppend(ab, " ", 1);
+            len++;
+        }
+
+    }
+    abAppend(ab, "\x1b[0m", 4);
+}
+void setStatusMsg(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(config.statusMsg, sizeof(config.statusMsg), fmt, ap);
+    va_end(ap);
+    config.statusMsgTime = time(NULL);
+}
+
+void drawMsgBar(abuf *ab)
+{
+    abAppend(ab, "\x1b[7m", 4);
+    char stats[80];
+    const char *msg = config.statusMsg;
+    int shown = msg[0] && time(NULL) - config.statusMsgTime < 3;
+    if(!shown && config.showFrameStats)
+    {
+        snprintf(stats, sizeof(stats), "Last frame %d bytes, %lld bytes per frame over %lld frames%s",
+            config.frameBytes, config.frameCount ? config.frameTotal / config.frameCount : 0,
+            config.frameCount, config.syncOutput ? " (synchronized)" : "");
+        msg = stats;
+        shown = 1;
+    }
+    int msglen = strlen(msg);
+    if(msglen > config.screencols) msglen = config.screencols;
+    if(shown)
+    {
+        if(msglen != 0)
+        {
+            abAppend(ab, msg, msglen);
+        }
+        for(int i = 0; i<config.screencols - msglen; i++)
+        {
+            abAppend(ab, " ", 1);
+        }
+    }
+    else
+    {
+        for(int i = 0; i<config.screencols; i++)
+        {
+            abAppend(ab, " ", 1);
+        }        
+    }
+
+    
+    abAppend(ab, "\x1b[m", 3);
+}
+/**terminal output**/
+
+//Cells a frame line takes on screen, escape sequences take none
+int lineWidth(abuf *ab)
+{
+    int width = 0;
+    for(int j = 0; j<ab->len; j++)
+    {
+        if(ab->s[j] == '\x1b' && j + 1 < ab->len && ab->s[j+1] == '[')
+        {
+            j += 2;
+            while(j < ab->len && !(ab->s[j] >= 0x40 && ab->s[j] <= 0x7e)) j++;
+        }
+        else if((ab->s[j] & 0xc0) != 0x80) width++; //UTF-8 continuation bytes share a cell
+    }
+    return width;
+}
+
+/**
+ * @brief Moves the terminal cursor with whichever of relative or absolute motion is shorter
+ *
+ * @param ab
+ * @param y
+ * @param x
+ */
+void termMove(abuf *ab, int y, int x)
+{
+    if(y == config.termY && x == config.termX) return;
+    char abs[32], rel[32];
+    int alen = snprintf(abs, sizeof(abs), "\x1b[%d;%dH", y + 1, x + 1);
+    int rlen = INT_MAX;
+    if(config.termY != -1)
+    {
+        rlen = 0;
+        int dy = y - config.termY;
+        if(dy < 0) rlen += snprintf(rel + rlen, sizeof(rel) - rlen, dy == -1 ? "\x1b[A" : "\x1b[%dA", -dy);
+        else if(dy > 0) rlen += snprintf(rel + rlen, sizeof(rel) - rlen, dy == 1 ? "\x1b[B" : "\x1b[%dB", dy);
+        int from = config.termX;
+        if(from == -1 || (x == 0 && from != 0))
+        {
+            rel[rlen++] = '\r';
+            from = 0;
+        }
+        int dx = x - from;
+        if(dx < 0) rlen += snprintf(rel + rlen, sizeof(rel) - rlen, dx == -1 ? "\x1b[D" : "\x1b[%dD", -dx);
+        else if(dx > 0) rlen += snprintf(rel + rlen, sizeof(rel) - rlen, dx == 1 ? "\x1b[C" : "\x1b[%dC", dx);
+    }
+    if(rlen <= alen) abAppend(ab, rel, rlen);
+    else abAppend(ab, abs, alen);
+    config.termY = y;
+    config.termX = x;
+}
+
+//Line buffers of one screen: the frame being built and what the terminal shows
+void frameAlloc(int lines, abuf **frame, abuf **shadow, int **shadowWidth)
+{
+    *frame = calloc(lines, sizeof(abuf));
+    *shadow = calloc(lines, sizeof(abuf));
+    *shadowWidth = calloc(lines, sizeof(int));
+}
+
+void termInit()
+{
+    frameAlloc(config.screenrows + 2, &config.frame, &config.shadow, &config.shadowWidth);
+    config.termY = config.termX = -1; //Unknown until the first frame clears the screen
+    config.frameBytes = 0;
+    config.frameTotal = config.frameCount = 0;
+    config.showFrameStats = 0;
+}
+
+/**
+ * @brief Writes only what changed between the shadow and the new frame
+ *
+ * Unchanged lines are skipped, a changed line is rewritten from the first
+ * differing cell and erased to the end only if it got shorter.
+ *
+ * @param cy cursor row on screen
+ * @param cx cursor column on screen
+ */
+void termFlush(int cy, int cx)
+{
+    int lines = config.screenrows + 2;
+    abuf ab = ABUF_INIT;
+    if(config.syncOutput) abAppend(&ab, "\x1b[?2026h", 8); //Terminal shows the frame at once
+    if(config.termY == -1)
+    {
+        abAppend(&ab, "\x1b[H\x1b[2J", 7);
+        config.termY = config.termX = 0;
+        for(int y = 0; y<lines; y++)
+        {
+            config.shadow[y].len = 0;
+            config.shadowWidth[y] = 0;
+        }
+    }
+    int hidden = 0;
+    for(int y = 0; y<lines; y++)
+    {
+        abuf *now = &config.frame[y];
+        abuf *old = &config.shadow[y];
+        if(now->len == old->len && memcmp(now->s, old->s, now->len) == 0) continue;
+        if(!hidden && !config.syncOutput)
+        {
+            abAppend(&ab, "\x1b[?25l", 6);
+            hidden = 1;
+        }
+        //Skip the common start, cells are counted over plain ASCII and the
+        //last attribute sequence in it is sent again before the new text
+        int same = 0, cells = 0, attr = -1, attrLen = 0;
+        while(same < now->len && same < old->len && now->s[same] == old->s[same])
+        {
+            if(now->s[same] == '\x1b')
+            {
+                int end = same + 1;
+                while(end < now->len && !(now->s[end] >= 0x40 && now->s[end] <= 0x7e && end > same + 1)) end++;
+                if(end >= now->len || end >= old->len || memcmp(now->s + same, old->s + same, end - same + 1)) break;
+                attr = same;
+                attrLen = end - same + 1;
+                same = end + 1;
+                continue;
+            }
+            if((unsigned char)now->s[same] >= 0x80) break;
+            same++;
+            cells++;
+        }
+        int width = lineWidth(now);
+        termMove(&ab, y, cells);
+        if(attr != -1) abAppend(&ab, now->s + attr, attrLen);
+        abAppend(&ab, now->s + same, now->len - same);
+        if(width < config.shadowWidth[y]) abAppend(&ab, "\x1b[K", 3);
+        config.termX = width < config.screencols ? width : -1; //Past the last column the position is unclear
+        config.shadowWidth[y] = width;
+    }
+    termMove(&ab, cy, cx);
+    if(hidden) abAppend(&ab, "\x1b[?25h", 6);
+    if(config.syncOutput) abAppend(&ab, "\x1b[?2026l", 8);
+
+    //Writes all the buffer at once
+    if(ab.len && write(config.outFd, ab.s, ab.len) == -1 && config.serving) config.clientGone = 1;
+    config.frameBytes = ab.len;
+    config.frameTotal += ab.len;
+    config.frameCount++;
+    abFree(&ab);
+
+    abuf *swap = config.shadow;
+    config.shadow = config.frame;
+    config.frame = swap;
+}
+
+/**
+ * @brief This function refreshes the screen after every keypress
+ *
+ */
+void refreshScreen()
+{
+    int lines = config.screenrows + 2;
+    for(int y = 0; y<lines; y++) config.frame[y].len = 0;
+
+    int cy = 0, cx = 0;
+    if(config.hexMode) hexDraw(config.frame, &cy, &cx);
+    else
+    {
+        scroll();
+        drawRows(config.frame);
+        cy = visibleBefore(config.cy) - visibleBefore(config.rowOff);
+        cx = config.rx - config.colOff;
+    }
+    drawStatusBar(&config.frame[config.screenrows]);
+    drawMsgBar(&config.frame[config.screenrows + 1]);
+
+    termFlush(cy, cx);
+    if(config.replay) keyDone();
+}
+
+
+/**session cache**/
+
+//Fixed part of a session file, followed by the search history and the line index
+typedef struct sessionHeader
+{
+    char magic[8];
+    long long dev, ino, size, mtime, mtimeNsec;
+    unsigned long long samples[SESSION_SAMPLES];
+    int cx, cy, rowOff, colOff;
+    int historyLen;
+    int hasIndex; //Rows are only stored while they match the file
+    long long numrow, scanOff, lineStart;
+    int scanWords, scanInWord;
+    nesting scanNest;
+    char scanLast;
+    int pathLen;
+} sessionHeader;
+
+static const char sessionMagic[8] = "TESESS2";
+
+/**
+ * @brief Name of the cache file for a document, under $XDG_CACHE_HOME or ~/.cache
+ *
+ * @param path absolute path of the document
+ * @return char* to be freed, NULL if there is no cache directory
+ */
+char *sessionFile(const char *path)
+{
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    if(base && *base) snprintf(dir, sizeof(dir), "%s/texteditor", base);
+    else if(home) snprintf(dir, sizeof(dir), "%s/.cache/texteditor", home);
+    else return NULL;
+    if(mkdir(dir, 0700) == -1 && errno != EEXIST)
+    {
+        //The parent may be missing as well
+        char parent[PATH_MAX];
+        snprintf(parent, sizeof(parent), "%s", dir);
+        *strrchr(parent, '/') = 0;
+        mkdir(parent, 0700);
+        if(mkdir(dir, 0700) == -1 && errno != EEXIST) return NULL;
+    }
+    char *name = malloc(PATH_MAX + 32);
+    snprintf(name, PATH_MAX + 32, "%s/%016llx", dir, hashBytes(path, strlen(path)));
+    return name;
+}
+
+//Hashes blocks spread evenly over the file, the first and the last included
+void sampleHashes(int fd, off_t size, unsigned long long *out)
+{
+    char block[SESSION_SAMPLE_SIZE];
+    for(int j = 0; j<SESSION_SAMPLES; j++)
+    {
+        off_t off = size > SESSION_SAMPLE_SIZE ? (size - SESSION_SAMPLE_SIZE) / (SESSION_SAMPLES - 1) * j : 0;
+        ssize_t n = pread(fd, block, sizeof(block), off);
+        out[j] = hashBytes(block, n > 0 ? n : 0);
+    }
+}
+
+void putVarint(FILE *fp, unsigned long long v)
+{
+    while(v >= 0x80)
+    {
+        putc((v & 0x7f) | 0x80, fp);
+        v >>= 7;
+    }
+    putc(v, fp);
+}
+
+int getVarint(FILE *fp, unsigned long long *v)
+{
+    *v = 0;
+    for(int shift = 0; shift < 64; shift += 7)
+    {
+        int c = getc(fp);
+        if(c == EOF) return -1;
+        *v |= (unsigned long long)(c & 0x7f) << shift;
+        if(!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+
+//Word and bracket counts of all rows in order
+void statCollect(int t, int *words, int *nets, int *lows, int *at)
+{
+    while(t)
+    {
+        statCollect(config.stat[t].left, words, nets, lows, at);
+        words[*at] = config.stat[t].words;
+        nets[*at] = config.stat[t].net;
+        lows[(*at)++] = config.stat[t].low;
+        t = config.stat[t].right;
+    }
+}
+
+//Net bracket counts are stored with the sign in the lowest bit
+unsigned long long zigzag(int v)
+{
+    return v < 0 ? ((unsigned long long)-(long long)v << 1) - 1 : (unsigned long long)v << 1;
+}
+
+int unzigzag(unsigned long long v)
+{
+    return v & 1 ? -(int)(v >> 1) - 1 : (int)(v >> 1);
+}
+
+int sessionKey(sessionHeader *hd, char *path)
+{
+    if(config.replay || config.record) return -1; //Recordings and their replays start from the same place every time
+    if(config.filename == NULL || realpath(config.filename, path) == NULL) return -1;
+    struct stat st;
+    if(stat(path, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+    memset(hd, 0, sizeof(*hd));
+    memcpy(hd->magic, sessionMagic, sizeof(hd->magic));
+    hd->dev = st.st_dev;
+    hd->ino = st.st_ino;
+    hd->size = st.st_size;
+    hd->mtime = st.st_mtim.tv_sec;
+    hd->mtimeNsec = st.st_mtim.tv_nsec;
+    hd->pathLen = strlen(path);
+    return 0;
+}
+
+/**
+ * @brief Stores the cursor, the search history and the line index of the file
+ *
+ * The index is written as row lengths, which rebuild the offsets, only while
+ * the document is unmodified so that every row still describes the file.
+ */
+void saveSession()
+{
+    sessionHeader hd;
+    char path[PATH_MAX];
+    if(sessionKey(&hd, path) == -1) return;
+    char *name = sessionFile(path);
+    if(name == NULL) return;
+    int fd = open(config.filename, O_RDONLY);
+    if(fd == -1)
+    {
+        free(name);
+        return;
+    }
+    sampleHashes(fd, hd.size, hd.samples);
+    close(fd);
+    hd.cx = config.cx;
+    hd.cy = config.cy;
+    hd.rowOff = config.rowOff;
+    hd.colOff = config.colOff;
+    hd.historyLen = config.searchHistory.len;
+    hd.hasIndex = config.srcFd != -1 && !config.dirty;
+    if(hd.hasIndex)
+    {
+        hd.numrow = config.numrow;
+        hd.scanOff = config.scanOff;
+        hd.lineStart = config.lineStart;
+        hd.scanWords = config.scanWords;
+        hd.scanInWord = config.scanInWord;
+        hd.scanNest = config.scanNest;
+        hd.scanLast = config.scanLast;
+    }
+
+    char tmp[PATH_MAX + 40];
+    snprintf(tmp, sizeof(tmp), "%s.%d", name, (int)getpid());
+    FILE *fp = fopen(tmp, "w");
+    if(fp == NULL)
+    {
+        free(name);
+        return;
+    }
+    fwrite(&hd, sizeof(hd), 1, fp);
+    fwrite(path, 1, hd.pathLen, fp);
+    for(int j = 0; j<hd.historyLen; j++)
+    {
+        int len = strlen(config.searchHistory.items[j]);
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(config.searchHistory.items[j], 1, len, fp);
+    }
+    if(hd.hasIndex)
+    {
+        int *words = malloc(sizeof(int) * (config.numrow + 1));
+        int *nets = malloc(sizeof(int) * (config.numrow + 1));
+        int *lows = malloc(sizeof(int) * (config.numrow + 1));
+        int n = 0;
+        statCollect(config.statRoot, words, nets, lows, &n);
+        for(int j = 0; j<config.numrow; j++)
+        {
+            //The gap to the next row tells whether the line ended in \r\n
+            off_t next = j + 1 < config.numrow ? config.row[j+1].foff : config.lineStart;
+            int cr = next - config.row[j].foff - config.row[j].size > 1;
+            putVarint(fp, ((unsigned long long)config.row[j].size << 1) | cr);
+            putVarint(fp, words[j]);
+            putVarint(fp, zigzag(nets[j]));
+            putVarint(fp, -(long long)lows[j]);
+        }
+        free(words);
+        free(nets);
+        free(lows);
+    }
+    //Renaming keeps a reader from seeing half a file
+    if(fclose(fp) == 0) rename(tmp, name);
+    else unlink(tmp);
+    free(name);
+}
+
+/**
+ * @brief Restores the previous session of an unchanged file
+ *
+ * Must run right after the file is opened, before anything is indexed.
+ */
+void loadSession()
+{
+    sessionHeader want, hd;
+    char path[PATH_MAX];
+    if(sessionKey(&want, path) == -1) return;
+    char *name = sessionFile(path);
+    if(name == NULL) return;
+    FILE *fp = fopen(name, "r");
+    free(name);
+    if(fp == NULL) return;
+    char stored[PATH_MAX];
+    if(fread(&hd, sizeof(hd), 1, fp) != 1 || memcmp(hd.magic, sessionMagic, sizeof(hd.magic))
+        || hd.dev != want.dev || hd.ino != want.ino || hd.size != want.size
+        || hd.mtime != want.mtime || hd.mtimeNsec != want.mtimeNsec
+        || hd.pathLen != want.pathLen || hd.pathLen >= PATH_MAX
+        || fread(stored, 1, hd.pathLen, fp) != (size_t)hd.pathLen || memcmp(stored, path, hd.pathLen))
+    {
+        fclose(fp);
+        return;
+    }
+    //Metadata can lie, a few sampled blocks catch most rewrites in place
+    int fd = config.srcFd != -1 ? config.srcFd : open(config.filename, O_RDONLY);
+    if(fd == -1)
+    {
+        fclose(fp);
+        return;
+    }
+    sampleHashes(fd, want.size, want.samples);
+    if(fd != config.srcFd) close(fd);
+    if(memcmp(hd.samples, want.samples, sizeof(want.samples)))
+    {
+        fclose(fp);
+        return;
+    }
+
+    for(int j = 0; j<hd.historyLen && j < HISTORY_MAX; j++)
+    {
+        int len;
+        if(fread(&len, sizeof(len), 1, fp) != 1 || len < 0 || len > 4096) break;
+        char *item = malloc(len + 1);
+        if(fread(item, 1, len, fp) != (size_t)len)
+        {
+            free(item);
+            break;
+        }
+        item[len] = 0;
+        historyAdd(&config.searchHistory, item);
+        free(item);
+    }
+    if(hd.hasIndex && config.srcFd != -1 && config.numrow == 0)
+    {
+        //The newline scan resumes where the last session stopped
+        off_t off = 0;
+        scanRows = 0;
+        int ok = 1;
+        for(long long j = 0; j<hd.numrow; j++)
+        {
+            unsigned long long len, words, net, low;
+            if(getVarint(fp, &len) == -1 || getVarint(fp, &words) == -1
+                || getVarint(fp, &net) == -1 || getVarint(fp, &low) == -1)
+            {
+                ok = 0;
+                break;
+            }
+            appendLazyRow(off, len >> 1, words, unzigzag(net), -(int)low);
+            off += (len >> 1) + (len & 1) + 1;
+        }
+        if(ok)
+        {
+            statAppend(statBuild(scanBytes, scanWordsOf, scanNetOf, scanLowOf, scanRows));
+            config.scanOff = hd.scanOff;
+            config.lineStart = hd.lineStart;
+            config.scanWords = hd.scanWords;
+            config.scanInWord = hd.scanInWord;
+            config.scanNest = hd.scanNest;
+            config.scanLast = hd.scanLast;
+        }
+        else
+        {
+            //A damaged index is dropped, the file is scanned as usual
+            for(int j = 0; j<config.numrow; j++) freeRow(&config.row[j]);
+            config.numrow = 0;
+        }
+        scanRows = 0;
+    }
+    fclose(fp);
+    config.cx = hd.cx;
+    moveToRow(hd.cy);
+    config.rowOff = hd.rowOff;
+    config.colOff = hd.colOff;
+}
+
+/**external changes**/
+
+int sameDiskFile(struct stat *st)
+{
+    return st->st_dev == config.disk.st_dev && st->st_ino == config.disk.st_ino
+        && st->st_size == config.disk.st_size
+        && st->st_mtim.tv_sec == config.disk.st_mtim.tv_sec
+        && st->st_mtim.tv_nsec == config.disk.st_mtim.tv_nsec;
+}
+
+//Hash of the bytes of fd in [off, off + len)
+unsigned long long hashSpan(int fd, off_t off, int len)
+{
+    static char block[HASH_BLOCK];
+    ssize_t n = pread(fd, block, len, off);
+    return hashBytes(block, n > 0 ? n : 0);
+}
+
+//Last row starting at or before a file offset, rows must describe the file
+int rowAtFileOffset(off_t off)
+{
+    int lo = 0, hi = config.numrow - 1;
+    if(hi < 0) return 0;
+    while(lo < hi)
+    {
+        int mid = lo + (hi - lo + 1) / 2;
+        if(config.row[mid].foff <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/**
+ * @brief Compares the file on disk with the block hashes of the loaded version
+ *
+ * Blocks are matched from the start, then from the end shifted by the change
+ * in size, which leaves the byte range that differs.
+ *
+ * @param fd the file as it is now
+ * @param size its size
+ * @return int 0 if the content is the same
+ */
+int findChange(int fd, off_t size)
+{
+    off_t oldSize = config.srcSize;
+    int hashed = config.hashOff / HASH_BLOCK; //Complete blocks with a hash
+    if(config.hashOff == oldSize && oldSize % HASH_BLOCK) hashed++; //and the short last one
+    int f = 0;
+    while(f < hashed)
+    {
+        off_t off = (off_t)f * HASH_BLOCK;
+        int len = oldSize - off < HASH_BLOCK ? oldSize - off : HASH_BLOCK;
+        if(off + len > size || hashSpan(fd, off, len) != config.blockHash[f]) break;
+        f++;
+    }
+    off_t delta = size - oldSize;
+    if(f == hashed && config.hashOff == oldSize && delta == 0) return 0;
+    config.changeStart = (off_t)f * HASH_BLOCK;
+    config.changeOldEnd = oldSize;
+    if(config.hashOff == oldSize)
+    {
+        //Walk back over blocks which only moved
+        for(int k = hashed - 1; k > f; k--)
+        {
+            off_t off = (off_t)k * HASH_BLOCK;
+            int len = oldSize - off < HASH_BLOCK ? oldSize - off : HASH_BLOCK;
+            if(off + delta < config.changeStart || hashSpan(fd, off + delta, len) != config.blockHash[k]) break;
+            config.changeOldEnd = off;
+        }
+    }
+    if(config.changeOldEnd > oldSize) config.changeOldEnd = oldSize;
+    config.changeNewEnd = config.changeOldEnd + delta;
+    if(config.changeNewEnd < config.changeStart)
+    {
+        config.changeNewEnd = config.changeStart;
+        config.changeOldEnd = config.changeStart - delta;
+    }
+    return 1;
+}
+
+/**
+ * @brief Looks at the file on disk once a second while the editor is idle
+ *
+ */
+void checkDisk()
+{
+    if(config.filename == NULL || config.diskChanged || config.disk.st_ino == 0) return;
+    time_t now = time(NULL);
+    if(now == config.diskChecked) return;
+    config.diskChecked = now;
+    struct stat st;
+    if(stat(config.filename, &st) == -1 || sameDiskFile(&st)) return;
+
+    config.diskPartial = 0;
+    if(config.srcFd != -1 && !config.dirty)
+    {
+        int fd = open(config.filename, O_RDONLY);
+        if(fd == -1) return;
+        int changed = findChange(fd, st.st_size);
+        close(fd);
+        if(!changed)
+        {
+            config.disk = st; //Only touched
+            return;
+        }
+        config.diskPartial = 1;
+    }
+    config.diskChanged = 1;
+    if(config.diskPartial)
+    {
+        int r0 = rowAtFileOffset(config.changeStart);
+        int r1 = rowAtFileOffset(config.changeOldEnd);
+        setStatusMsg("File changed on disk around lines %d-%d%s. Ctrl-R reloads them",
+            r0 + 1, r1 + 1, config.changeOldEnd >= config.lineStart ? "+" : "");
+    }
+    else
+    {
+        setStatusMsg("File changed on disk. Ctrl-R reloads it%s", config.dirty ? " and drops your changes" : "");
+    }
+    refreshScreen();
+}
+
+/**
+ * @brief Tells whether saving would overwrite someone else's changes
+ *
+ * @return int
+ */
+int diskDiverged()
+{
+    struct stat st;
+    if(config.filename == NULL || config.disk.st_ino == 0) return 0;
+    if(stat(config.filename, &st) == -1) return 0; //Gone, saving recreates it
+    if(sameDiskFile(&st)) return 0;
+    if(config.srcFd != -1 && config.hashOff == config.srcSize)
+    {
+        int fd = open(config.filename, O_RDONLY);
+        if(fd == -1) return 1;
+        int changed = findChange(fd, st.st_size);
+        close(fd);
+        if(!changed)
+        {
+            config.disk = st;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//Drops the statistics nodes of a subtree
+void statFreeTree(int t)
+{
+    while(t)
+    {
+        statFreeTree(config.stat[t].left);
+        int right = config.stat[t].right;
+        config.stat[t].left = config.statFree;
+        config.statFree = t;
+        t = right;
+    }
+}
+
+//Removes rows [from, to) with one memmove
+void dropRows(int from, int to)
+{
+    dropUndo(); //Rows move under it
+    for(int j = from; j<to; j++) freeRow(&config.row[j]);
+    memmove(&config.row[from], &config.row[to], sizeof(erow) * (config.numrow - to));
+    config.numrow -= to - from;
+    int l, m, r;
+    statSplit(config.statRoot, from, &l, &r);
+    statSplit(r, to - from, &m, &r);
+    statFreeTree(m);
+    config.statRoot = statMerge(l, r);
+}
+
+/**
+ * @brief Replaces the rows of the changed byte range with the lines now in the file
+ *
+ * Rows after the range keep their text on disk and only move by the change in
+ * size. When the change reaches the end of what is indexed the rows from its
+ * start are dropped and indexing starts again there.
+ *
+ * @return int first reloaded row
+ */
+int reloadChange()
+{
+    int fd = open(config.filename, O_RDONLY);
+    if(fd == -1) return -1;
+    struct stat st;
+    fstat(fd, &st);
+    off_t delta = st.st_size - config.srcSize;
+    int r0 = rowAtFileOffset(config.changeStart);
+    int r1 = rowAtFileOffset(config.changeOldEnd);
+    off_t start = config.numrow ? config.row[r0].foff : 0;
+    off_t oldEnd = r1 + 1 < config.numrow ? config.row[r1 + 1].foff : config.lineStart;
+    releaseSource();
+    config.srcFd = fd;
+    config.srcSize = st.st_size;
+    config.disk = st;
+    config.hashOff = 0; //Hashed again while idle
+    if(r1 + 1 >= config.numrow || oldEnd - start > INDEX_CHUNK)
+    {
+        dropRows(r0, config.numrow);
+        config.scanOff = config.lineStart = start;
+        config.scanWords = config.scanInWord = 0;
+        config.scanNest = (nesting)NESTING_INIT;
+        config.scanLast = 0;
+        if(start > 0) pread(fd, &config.scanLast, 1, start - 1);
+        return r0;
+    }
+
+    off_t newEnd = oldEnd + delta;
+    int len = newEnd - start;
+    char *buf = malloc(len + 1);
+    readSpan(buf, len, start);
+    dropRows(r0, r1 + 1);
+    //The range ends right after a newline, so it splits into whole lines
+    scanRows = 0;
+    erow *after = malloc(sizeof(erow) * (config.numrow - r0));
+    memcpy(after, &config.row[r0], sizeof(erow) * (config.numrow - r0));
+    int tail = config.numrow - r0;
+    config.numrow = r0;
+    char *p = buf, *nl;
+    while(p < buf + len && (nl = memchr(p, '\n', buf + len - p)) != NULL)
+    {
+        int size = nl - p;
+        if(size > 0 && nl[-1] == '\r') size--;
+        int inWord = 0;
+        nesting nest = NESTING_INIT;
+        countNesting(p, size, &nest);
+        appendLazyRow(start + (p - buf), size, countWords(p, size, &inWord), nest.net, nest.low);
+        p = nl + 1;
+    }
+    int added = config.numrow - r0;
+    growRows(config.numrow + tail);
+    memcpy(&config.row[config.numrow], after, sizeof(erow) * tail);
+    config.numrow += tail;
+    free(after);
+    free(buf);
+    for(int j = r0 + added; j<config.numrow; j++) config.row[j].foff += delta;
+    config.scanOff += delta;
+    config.lineStart += delta;
+    int l, r;
+    statSplit(config.statRoot, r0, &l, &r);
+    config.statRoot = statMerge(statMerge(l, statBuild(scanBytes, scanWordsOf, scanNetOf, scanLowOf, scanRows)), r);
+    scanRows = 0;
+    return r0;
+}
+
+//Ctrl-R after a change on disk was reported
+void reloadFile()
+{
+    if(!config.diskChanged)
+    {
+        setStatusMsg("File on disk has not changed");
+        return;
+    }
+    config.diskChanged = 0;
+    if(config.diskPartial)
+    {
+        int r0 = reloadChange();
+        if(r0 == -1)
+        {
+            setStatusMsg("Can't reload: %s", strerror(errno));
+            return;
+        }
+        moveToRow(config.cy);
+        setStatusMsg("Reloaded from line %d", r0 + 1);
+        return;
+    }
+    int cx = config.cx, cy = config.cy, rowOff = config.rowOff;
+    int columnMode = config.columnMode;
+    char *filename = strdup(config.filename);
+    closeDocument();
+    if(openDocument(filename) == -1) err(filename);
+    free(filename);
+    if(columnMode) setColumnMode(1);
+    config.cx = cx;
+    moveToRow(cy);
+    config.rowOff = rowOff;
+    setStatusMsg("Reloaded %s", config.filename);
+}
+
+/**recording**/
+
+long long nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Starts writing every input byte to a recording
+ *
+ * The file holds the magic, the window size and then one event per byte:
+ * a varint of the microseconds since the last event shifted left by one,
+ * with the low bit set for a read which timed out, then the byte.
+ *
+ * @param path
+ * @return int -1 with errno set on failure
+ */
+int startRecording(const char *path)
+{
+    config.record = fopen(path, "wb");
+    if(config.record == NULL) return -1;
+    fwrite(RECORD_MAGIC, 1, 8, config.record);
+    putVarint(config.record, config.screenrows + 2);
+    putVarint(config.record, config.screencols);
+    config.recordLast = nowUs();
+    return 0;
+}
+
+void recordByte(int b)
+{
+    long long now = nowUs();
+    putVarint(config.record, (unsigned long long)(now - config.recordLast) << 1 | (b < 0));
+    if(b >= 0) fputc(b, config.record);
+    config.recordLast = now;
+}
+
+/**
+ * @brief Reads one input byte from the terminal or the replayed recording
+ *
+ * @param c
+ * @param wait 0 inside an escape sequence, where a timeout ends the key
+ * @return int 1 for a byte, 0 on timeout
+ */
+int readByte(char *c, int wait)
+{
+    if(config.replay)
+    {
+        unsigned long long ev;
+        if(getVarint(config.replay, &ev) == -1)
+        {
+            if(wait) exit(0); //Recording is over, the report is printed at exit
+            return 0;
+        }
+        if(ev & 1) return 0;
+        int b = fgetc(config.replay);
+        if(b == EOF) exit(0);
+        *c = b;
+        return 1;
+    }
+    if(config.serving)
+    {
+        //A client which left answers every prompt with escape
+        struct pollfd pfd = {config.inFd, POLLIN, 0};
+        if(!config.clientGone && poll(&pfd, 1, 1000) == 0) return 0;
+        if(config.clientGone || read(config.inFd, c, 1) != 1)
+        {
+            config.clientGone = 1;
+            *c = '\x1b';
+        }
+        return 1;
+    }
+    int n = read(config.inFd, c, 1);
+    //Timeouts only matter inside escape sequences, idle ones are not kept
+    if(config.record && (n == 1 || (n == 0 && !wait))) recordByte(n == 1 ? (unsigned char)*c : -1);
+    return n;
+}
+
+//Latency and output of every replayed key
+static int *lagKey, *lagBytes;
+static long long *lagUs;
+static int lagLen, lagCap;
+
+void keyRead(int c)
+{
+    config.keyStart = nowUs();
+    config.keyCode = c;
+}
+
+//The screen was drawn after a replayed key
+void keyDone()
+{
+    if(config.keyStart == 0) return;
+    if(lagLen == lagCap)
+    {
+        lagCap = lagCap ? lagCap * 2 : 1024;
+        lagKey = realloc(lagKey, sizeof(int) * lagCap);
+        lagBytes = realloc(lagBytes, sizeof(int) * lagCap);
+        lagUs = realloc(lagUs, sizeof(long long) * lagCap);
+    }
+    lagKey[lagLen] = config.keyCode;
+    lagBytes[lagLen] = config.frameBytes;
+    lagUs[lagLen++] = nowUs() - config.keyStart;
+    config.keyStart = 0;
+}
+
+int lagCmp(const void *a, const void *b)
+{
+    long long p = *(const long long *)a, q = *(const long long *)b;
+    return (p > q) - (p < q);
+}
+
+//Prints one line per replayed key and a summary to stderr
+void replayReport()
+{
+    long long total = 0, bytes = 0;
+    fprintf(stderr, "key\tlatency_us\tbytes\n");
+    for(int j = 0; j<lagLen; j++)
+    {
+        fprintf(stderr, "%d\t%lld\t%d\n", lagKey[j], lagUs[j], lagBytes[j]);
+        total += lagUs[j];
+        bytes += lagBytes[j];
+    }
+    if(lagLen == 0) return;
+    long long *sorted = malloc(sizeof(long long) * lagLen);
+    memcpy(sorted, lagUs, sizeof(long long) * lagLen);
+    qsort(sorted, lagLen, sizeof(long long), lagCmp);
+    fprintf(stderr, "# %d keys, latency us: mean %lld p50 %lld p90 %lld p99 %lld max %lld, %lld bytes written\n",
+        lagLen, total / lagLen, sorted[lagLen / 2], sorted[lagLen * 9 / 10], sorted[lagLen * 99 / 100],
+        sorted[lagLen - 1], bytes);
+    free(sorted);
+}
+
+/**
+ * @brief Feeds a recording to the editor instead of the terminal
+ *
+ * @param path
+ * @return int -1 with errno set on failure
+ */
+int startReplay(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL) return -1;
+    char magic[8];
+    unsigned long long rows, cols;
+    if(fread(magic, 1, 8, fp) != 8 || memcmp(magic, RECORD_MAGIC, 8) != 0
+        || getVarint(fp, &rows) == -1 || getVarint(fp, &cols) == -1 || rows < 3 || rows > USHRT_MAX || cols > USHRT_MAX)
+    {
+        fclose(fp);
+        errno = EINVAL;
+        return -1;
+    }
+    config.replay = fp;
+    config.screenrows = rows;
+    config.screencols = cols;
+    atexit(replayReport);
+    return 0;
+}
+
+/**server**/
+
+//Socket of the server holding a file, named after its real path
+int serverAddress(const char *filename, struct sockaddr_un *addr)
+{
+    char path[PATH_MAX], dir[PATH_MAX];
+    if(realpath(filename, path) == NULL)
+    {
+        //A new file, the server creates it on save
+        if(strlen(filename) >= sizeof(path)) return -1;
+        strcpy(path, filename);
+    }
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if(runtime && *runtime) snprintf(dir, sizeof(dir), "%s/texteditor", runtime);
+    else snprintf(dir, sizeof(dir), "/tmp/texteditor-%d", (int)getuid());
+    if(mkdir(dir, 0700) == -1 && errno != EEXIST) return -1;
+    //Another user could have made it first in a shared /tmp, only our own private directory is used
+    struct stat st;
+    if(lstat(dir, &st) == -1) return -1;
+    if(!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0777) != 0700)
+    {
+        errno = EPERM;
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%016llx.sock", dir, hashBytes(path, strlen(path)));
+    if(n >= (int)sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+//Moves a client's view into config
+void viewLoad(client *c)
+{
+    config.inFd = config.outFd = c->fd;
+    config.cx = c->cx;
+    config.cy = c->cy;
+    config.rx = c->rx;
+    config.rowOff = c->rowOff;
+    config.colOff = c->colOff;
+    config.screenrows = c->screenrows;
+    config.screencols = c->screencols;
+    config.markSet = c->markSet;
+    config.mx = c->mx;
+    config.my = c->my;
+    config.cursors = c->cursors;
+    config.ncursors = c->ncursors;
+    config.cursorCap = c->cursorCap;
+    config.syncOutput = c->syncOutput;
+    config.frame = c->frame;
+    config.shadow = c->shadow;
+    config.shadowWidth = c->shadowWidth;
+    config.termY = c->termY;
+    config.termX = c->termX;
+    memcpy(config.statusMsg, c->statusMsg, sizeof(c->statusMsg));
+    config.statusMsgTime = c->statusMsgTime;
+    config.clientGone = 0;
+    //Another client may have removed rows under this view
+    if(config.cy > config.numrow) config.cy = config.numrow;
+    if(config.my > config.numrow) config.my = config.numrow;
+    int size = config.cy < config.numrow ? rowAt(config.cy)->size : 0;
+    if(config.cx > size) config.cx = size;
+    for(int j = 0; j<config.ncursors; j++)
+    {
+        cursor *k = &config.cursors[j];
+        if(k->y >= config.numrow) k->y = config.numrow ? config.numrow - 1 : 0;
+        size = k->y < config.numrow ? rowAt(k->y)->size : 0;
+        if(k->x > size) k->x = size;
+    }
+}
+
+void viewStore(client *c)
+{
+    c->cx = config.cx;
+    c->cy = config.cy;
+    c->rx = config.rx;
+    c->rowOff = config.rowOff;
+    c->colOff = config.colOff;
+    c->markSet = config.markSet;
+    c->mx = config.mx;
+    c->my = config.my;
+    c->cursors = config.cursors;
+    c->ncursors = config.ncursors;
+    c->cursorCap = config.cursorCap;
+    c->termY = config.termY;
+    c->termX = config.termX;
+    memcpy(c->statusMsg, config.statusMsg, sizeof(c->statusMsg));
+    c->statusMsgTime = config.statusMsgTime;
+}
+
+/**
+ * @brief Reads the greeting of a new client and gives it a fresh view
+ *
+ * @param fd
+ * @param c
+ * @return int -1 if fd is not a client
+ */
+int clientAttach(int fd, client *c)
+{
+    clientHello hello;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if(poll(&pfd, 1, 1000) != 1 || read(fd, &hello, sizeof(hello)) != sizeof(hello)
+        || memcmp(hello.magic, CLIENT_MAGIC, 8) != 0 || hello.rows < 3 || hello.cols < 1) return -1;
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->screenrows = hello.rows - 2;
+    c->screencols = hello.cols;
+    c->syncOutput = hello.syncOutput;
+    //Frames for this view, the first one redraws the whole screen
+    frameAlloc(c->screenrows + 2, &c->frame, &c->shadow, &c->shadowWidth);
+    c->termY = c->termX = -1;
+    snprintf(c->statusMsg, sizeof(c->statusMsg), "Attached to %s. Ctrl-Q detaches, the file stays open",
+        config.filename ? config.filename : "[Untitled]");
+    c->statusMsgTime = time(NULL);
+    return 0;
+}
+
+void clientDetach(client *c)
+{
+    close(c->fd);
+    for(int y = 0; y<c->screenrows + 2; y++)
+    {
+        abFree(&c->frame[y]);
+        abFree(&c->shadow[y]);
+    }
+    free(c->frame);
+    free(c->shadow);
+    free(c->shadowWidth);
+    free(c->cursors);
+}
+
+//Redraws every view, the output layer only sends what changed on each
+void refreshClients(client *clients, int n)
+{
+    for(int j = 0; j<n; j++)
+    {
+        viewLoad(&clients[j]);
+        refreshScreen();
+        viewStore(&clients[j]);
+    }
+}
+
+/**
+ * @brief Keeps the document open and serves the clients connecting to listenFd
+ *
+ * Keys are handled one client at a time. A client in a prompt holds the others
+ * until the prompt is done.
+ *
+ * @param listenFd
+ * @param filename
+ * @param path socket to remove on exit
+ */
+void serve(int listenFd, char *filename, const char *path)
+{
+    config.serving = 1;
+    config.screenrows = 3; //Until a client brings its size
+    config.screencols = 80;
+    initEditor();
+    if(editorOpen(filename) == -1)
+    {
+        //The client which started us is waiting on the socket, it is told why before it goes
+        int saved = errno;
+        struct pollfd pfd = {listenFd, POLLIN, 0};
+        if(poll(&pfd, 1, 5000) == 1)
         {
-            if(buflen != 0)
+            int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+            clientHello hello;
+            if(fd != -1 && read(fd, &hello, sizeof(hello)) == sizeof(hello))
             {
-                setStatusMsg("");
-                if (callback) callback(buf, c);
-                return buf;
+                char msg[PATH_MAX + 128];
+                int len = snprintf(msg, sizeof(msg), "%s: %s\r\n", filename, strerror(saved));
+                writeAll(fd, msg, len < (int)sizeof(msg) ? len : (int)sizeof(msg) - 1);
             }
+            if(fd != -1) close(fd);
         }
-        else if(c == '\x1b') //Esc to cancel
+        unlink(path);
+        exit(1);
+    }
+    client *clients = NULL;
+    int n = 0, cap = 0;
+    time_t lonely = time(NULL);
+    for(;;)
+    {
+        struct pollfd *pfd = malloc(sizeof(struct pollfd) * (n + 1));
+        pfd[0] = (struct pollfd){listenFd, POLLIN, 0};
+        for(int j = 0; j<n; j++) pfd[j + 1] = (struct pollfd){clients[j].fd, POLLIN, 0};
+        int idle = !config.hexMode && (isIndexing() || isHashing());
+        int ready = poll(pfd, n + 1, idle ? 0 : 1000);
+        if(ready == -1 && errno != EINTR) err("poll");
+        if(ready <= 0)
         {
-            setStatusMsg("");
-            if (callback) callback(buf, c);
-            free(buf);
-            return NULL;
+            free(pfd);
+            if(idle)
+            {
+                if(isIndexing())
+                {
+                    indexTo(config.scanOff + INDEX_CHUNK);
+                    refreshClients(clients, n);
+                }
+                else hashTo(config.hashOff + INDEX_CHUNK);
+            }
+            else if(n)
+            {
+                viewLoad(&clients[0]);
+                checkDisk();
+                viewStore(&clients[0]);
+            }
+            else if(!config.dirty && !config.hexDirty && time(NULL) - lonely > SERVER_IDLE) break;
+            continue;
         }
-        else if(!iscntrl(c) && c<128)
+        int polled = n; //A client attached below was not polled yet
+        if(pfd[0].revents & POLLIN)
         {
-            if(buflen == bufsize -1)
+            int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+            if(n == cap)
             {
-                bufsize = bufsize*2; //Increase buffer size when overflow
-                buf = realloc(buf, bufsize);
+                cap = cap ? cap * 2 : 4;
+                clients = realloc(clients, sizeof(client) * cap);
             }
-            buf[buflen++] = c;
-            buf[buflen] = 0;
+            if(fd != -1 && clientAttach(fd, &clients[n]) == 0)
+            {
+                n++;
+                refreshClients(&clients[n-1], 1);
+            }
+            else if(fd != -1) close(fd);
         }
-        if (callback) callback(buf, c);
+        for(int j = 0; j<polled; j++)
+        {
+            if(!(pfd[j + 1].revents & (POLLIN | POLLHUP))) continue;
+            viewLoad(&clients[j]);
+            processKeyPress();
+            while(config.keyQueued && !config.clientGone) processKeyPress(); //Typed while a command ran
+            int gone = config.clientGone;
+            viewStore(&clients[j]);
+            if(gone)
+            {
+                config.keyQueued = 0;
+                clientDetach(&clients[j]);
+                memmove(&clients[j], &clients[j + 1], sizeof(client) * (n - j - 1));
+                memmove(&pfd[j + 1], &pfd[j + 2], sizeof(struct pollfd) * (polled - j - 1));
+                n--;
+                polled--;
+                j--;
+                lonely = time(NULL);
+            }
+            refreshClients(clients, n); //Everyone sees the edit
+        }
+        free(pfd);
     }
+    unlink(path);
+    saveSession();
+    exit(0);
 }
+
 /**
- * @brief This function moves the cursor
+ * @brief Client side of -c, starts the server for the file if there is none
  *
- * @param key
+ * The client only passes the terminal input to the server and the frames
+ * back to the terminal.
+ *
+ * @param filename
+ * @return int exit status
  */
-void moveCursor(int key)
+int runClient(char *filename)
 {
-    erow *row;
-    if(config.cy >= config.numrow)
+    struct sockaddr_un addr;
+    if(serverAddress(filename, &addr) == -1)
     {
-        row = NULL; //If cursor moves past end of file, row is null
+        perror(filename);
+        return 1;
     }
-    else
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
     {
-        row = &config.row[config.cy]; //else row points to the current line in the file
+        //No server yet, the listening socket is made here so connecting can't race it
+        unlink(addr.sun_path);
+        int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(listenFd == -1 || bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listenFd, 16) == -1)
+        {
+            perror(addr.sun_path);
+            return 1;
+        }
+        pid_t pid = fork();
+        if(pid == -1)
+        {
+            perror("fork");
+            return 1;
+        }
+        if(pid == 0)
+        {
+            setsid();
+            int null = open("/dev/null", O_RDWR);
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            if(null > STDERR_FILENO) close(null);
+            serve(listenFd, filename, addr.sun_path);
+        }
+        close(listenFd);
+        if(fd != -1) close(fd);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            perror(addr.sun_path);
+            return 1;
+        }
     }
-    switch(key)
+    enableRawMode();
+    probeTerminal();
+    clientHello hello;
+    memcpy(hello.magic, CLIENT_MAGIC, 8);
+    if(getWindowSize(&hello.rows, &hello.cols) == -1) err("getWindowSize");
+    hello.syncOutput = config.syncOutput;
+    if(write(fd, &hello, sizeof(hello)) != sizeof(hello)) err("write");
+    char buf[PIPE_BUF_SIZE];
+    for(;;)
     {
-        case ARROW_LEFT:
-            if(config.cx != 0) config.cx--;
-            else if(config.cy > 0)
-            {
-                //moving cursor to end of prev line
-                config.cy--;
-                config.cx = config.row[config.cy].size;
-            }
-            break;
-        case ARROW_UP:
-            if(config.cy != 0) config.cy--;
-            break;
-        case ARROW_DOWN:
-            if(config.cy < config.numrow) config.cy++;
-            break;
-        case ARROW_RIGHT:
-            if(row && config.cx < row->size)
-                config.cx++; //increment cx only till length of the current row
-            else if (row && config.cx == row->size)
-            {
-                config.cy++;
-                config.cx = 0;
-            }
+        struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+        if(poll(pfd, 2, -1) == -1 && errno != EINTR) err("poll");
+        if(pfd[0].revents & POLLIN)
+        {
+            ssize_t got = read(STDIN_FILENO, buf, sizeof(buf));
+            if(got > 0 && writeAll(fd, buf, got) == -1) break;
+        }
+        if(pfd[1].revents & (POLLIN | POLLHUP))
+        {
+            ssize_t got = read(fd, buf, sizeof(buf));
+            if(got <= 0) break; //Detached or the server is gone
+            writeAll(STDOUT_FILENO, buf, got);
+        }
+    }
+    return 0;
+}
 
-            break;
+/**transforms**/
+
+//Rows a command works on: the selected lines, or the whole document
+void commandRange(int *from, int *to)
+{
+    int sy, sx, ey, ex;
+    if(getSelection(&sy, &sx, &ey, &ex))
+    {
+        *from = sy;
+        *to = ex > 0 || ey == sy ? ey + 1 : ey; //A selection ending at the start of a line leaves it out
+        if(*to > config.numrow) *to = config.numrow;
+        return;
     }
+    indexRows(INT_MAX);
+    *from = 0;
+    *to = config.numrow;
+}
 
-    //Since after moving from a long line to
-    //a shorter line cx remains same as that of position in longer line we need to
-    //modify cx
-    row = (config.cy>=config.numrow) ? NULL:&config.row[config.cy];
-    int rowlen = row ? row->size: 0;
-    if(config.cx > rowlen) config.cx = rowlen;
+int threadCount(int rows)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1) n = 1;
+    if(n > THREADS_MAX) n = THREADS_MAX;
+    int most = rows / THREAD_ROWS_MIN;
+    return most < 1 ? 1 : most < n ? most : n;
 }
 
-/**
- * @brief This function processes the keypress
- *
- */
-void processKeyPress()
+//Frees what the last command kept for undo
+void dropUndo()
 {
-    static int quit_time = QUIT_TIME;
-    int c = readKey();
-    switch(c)
+    undoRecord *u = &config.undo;
+    if(!u->set) return;
+    for(int j = 0; j<u->goneLen; j++) freeRow(&u->gone[j]);
+    statFreeTree(u->tree);
+    free(u->gone);
+    free(u->goneAt);
+    free(u->source);
+    if(u->srcFd != -1) close(u->srcFd);
+    u->set = 0;
+}
+
+//Closes the source file, unless unloaded rows kept for undo still point into it
+void releaseSource()
+{
+    undoRecord *u = &config.undo;
+    if(u->set && u->srcFd == -1)
     {
-        //present in ttydefaults already included
-        case CTRL('q'):
-            if(config.dirty && quit_time>0)
+        for(int j = 0; j<u->goneLen; j++)
+        {
+            if(u->gone[j].chars == NULL)
             {
-                setStatusMsg("WARNING !! Unsaved changes. "
-                "Press ctrl-q %d more times.", quit_time);
-                quit_time--;
+                u->srcFd = config.srcFd;
                 return;
             }
-            //clear screen then exit
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
-            exit(0);
-        case CTRL('s'):
-            saveFile();
-            break;
-        case HOME:
-            config.cx = 0;
-            break;
-        case END:
-            if(config.cy<config.numrow) config.cx = config.row[config.cy].size-1;
-            break;
-        case PAGE_UP:
-        case PAGE_DOWN:
-        {
-            if (c == PAGE_UP) {
-            config.cy = config.rowOff;
-            } else if (c == PAGE_DOWN) {
-            config.cy = config.rowOff + config.screenrows - 1;
-            if (config.cy > config.numrow) config.cy = config.numrow;
-            }
-            int times = config.screenrows;
-            while (times--)
-            moveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
         }
-            break;
-        case ARROW_UP:
-        case ARROW_DOWN:
-        case ARROW_LEFT:
-        case ARROW_RIGHT:
-            moveCursor(c);
-            break;
-        case '\r':
-            insertNewLine();
-            break;
-        case BACKSPACE:
-        case CTRL('h'):
-        case DEL:
-            if(c == DEL) moveCursor(ARROW_RIGHT);
-            DelChar();
-            break;
-        case '\x1b':
-            break;
-        case CTRL('f'):
-            findText();
-            break;
-        default:
-            insertChar(c);
-            break;
     }
-    quit_time = QUIT_TIME;
+    close(config.srcFd);
+}
+
+//Puts the cursor at the start of a range which was replaced
+void cursorToRange(int from)
+{
+    clearCursors();
+    config.markSet = 0;
+    config.colStale = 1;
+    config.cx = 0;
+    moveToRow(from);
+    revealRow(config.cy);
 }
 
 /**
- * @brief This function gets the cursor position
+ * @brief Puts new rows in place of [from, from + n) as one step which Ctrl-Z reverts
  *
- * @param row
- * @param col
- * @return int
- * */
-int getCursorPosition(unsigned short int *row, unsigned short int *col)
+ * Rows of the range which are kept are moved, not copied. The rows removed and
+ * the statistics of the range are kept until the next command. Removed rows
+ * which are not loaded stay in the file, a save keeps the old file open for them.
+ *
+ * @param from
+ * @param n rows replaced
+ * @param rows the new rows, moved into the document
+ * @param m number of new rows
+ * @param source for each new row its place in the range or -1, owned by the undo record
+ */
+void replaceRange(int from, int n, erow *rows, int m, int *source)
 {
-    *row = *col = 0;
+    dropUndo();
+    //Folds reaching into the range are opened whole, none is left half hidden
+    int lo = from, hi = from + n;
+    while(lo > 0 && isHidden(lo)) lo--;
+    while(hi < config.numrow && isHidden(hi)) hi++;
+    int hidden = hi - lo - (visibleBefore(hi) - visibleBefore(lo));
+    if(hidden)
+    {
+        statSetHidden(lo, hi, 0);
+        config.unfolded += hidden;
+    }
+    undoRecord *u = &config.undo;
+    int l, mid, r;
+    statSplit(config.statRoot, from, &l, &r);
+    statSplit(r, n, &mid, &r);
+    int *words = malloc(sizeof(int) * (n + m + 1) * 4);
+    int *nets = words + n + m + 1, *lows = nets + n + m + 1, *bytes = lows + n + m + 1;
+    int k = 0;
+    statCollect(mid, words, nets, lows, &k);
 
-    //ESC [ Ps n Ps = 6 means Command from host – Please report active position (using a CPR control sequence)
-    if(write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
-    char parse_buf[32] = {0};
-    //Now the terminal will return an escape sequence of form 27[r;cR r = row, c = col. we have to parse it
-    short int i = 0;
-    while(i<(short int)(sizeof(parse_buf)-1))
+    //Old counts are moved along with their rows, new rows are counted
+    char *kept = calloc(n + 1, 1);
+    int *newWords = words + n, *newNets = nets + n, *newLows = lows + n;
+    for(int j = 0; j<m; j++)
     {
-        if(read(STDIN_FILENO, &parse_buf[i], 1) != 1) break;
-        if (parse_buf[i] == 'R') break;
-        i++;
+        bytes[j] = rows[j].size + 1;
+        if(source[j] >= 0)
+        {
+            kept[source[j]] = 1;
+            newWords[j] = words[source[j]];
+            newNets[j] = nets[source[j]];
+            newLows[j] = lows[source[j]];
+            continue;
+        }
+        int inWord = 0;
+        nesting nest = NESTING_INIT;
+        countNesting(rows[j].chars, rows[j].size, &nest);
+        newWords[j] = countWords(rows[j].chars, rows[j].size, &inWord);
+        newNets[j] = nest.net;
+        newLows[j] = nest.low;
     }
+    u->gone = malloc(sizeof(erow) * (n + 1));
+    u->goneAt = malloc(sizeof(int) * (n + 1));
+    u->goneLen = 0;
+    for(int j = 0; j<n; j++)
+    {
+        if(kept[j]) continue;
+        u->gone[u->goneLen] = config.row[from + j];
+        u->goneAt[u->goneLen++] = j;
+    }
+    free(kept);
 
-    //No idea why this loop is insanely slow
-    // while(parse_buf[i] != 'R')
-    // {
-    // 	if(read(STDIN_FILENO, &parse_buf[i], 1) != 1) break;
-    // 	i++;
-    // }
-    // printf("\r\n&buf[i]: %s\r\n", &parse_buf[1]);
-    if(parse_buf[0] != '\x1b' || parse_buf[1] != '[')
+    growRows(config.numrow - n + m);
+    memmove(&config.row[from + m], &config.row[from + n], sizeof(erow) * (config.numrow - from - n));
+    memcpy(&config.row[from], rows, sizeof(erow) * m);
+    config.numrow += m - n;
+    config.statRoot = statMerge(statMerge(l, statBuild(bytes, newWords, newNets, newLows, m)), r);
+    free(words);
+    for(int j = 0; j<m; j++)
     {
-        return -1;
+        if(source[j] < 0) updateRow(&config.row[from + j]);
     }
-    if(sscanf(&parse_buf[2], "%hu;%hu", row, col) != 2)
+
+    u->set = 1;
+    u->srcFd = -1;
+    u->from = from;
+    u->rows = n;
+    u->newRows = m;
+    u->source = source;
+    u->tree = mid;
+    u->dirty = ++config.dirty;
+    cursorToRange(from);
+}
+
+//Ctrl-Z, puts back the rows the last command replaced
+void undoRange()
+{
+    undoRecord *u = &config.undo;
+    if(!u->set || u->dirty != config.dirty)
     {
-        return -1;
+        setStatusMsg("Nothing to undo, Ctrl-Z only reverts the last command before other edits");
+        return;
     }
-    return 0;
+    long long start = nowUs();
+    erow *old = malloc(sizeof(erow) * (u->rows + 1));
+    for(int j = 0; j<u->newRows; j++)
+    {
+        erow *row = &config.row[u->from + j];
+        if(u->source[j] >= 0) old[u->source[j]] = *row;
+        else freeRow(row);
+    }
+    if(u->srcFd != -1)
+    {
+        //Gone rows still in the file a save replaced are read from it before they come back
+        int fd = config.srcFd;
+        config.srcFd = u->srcFd;
+        for(int j = 0; j<u->goneLen; j++) rowLoad(&u->gone[j]);
+        config.srcFd = fd;
+        close(u->srcFd);
+    }
+    for(int j = 0; j<u->goneLen; j++) old[u->goneAt[j]] = u->gone[j];
+    growRows(config.numrow - u->newRows + u->rows);
+    memmove(&config.row[u->from + u->rows], &config.row[u->from + u->newRows],
+        sizeof(erow) * (config.numrow - u->from - u->newRows));
+    memcpy(&config.row[u->from], old, sizeof(erow) * u->rows);
+    config.numrow += u->rows - u->newRows;
+    free(old);
+
+    int l, mid, r;
+    statSplit(config.statRoot, u->from, &l, &r);
+    statSplit(r, u->newRows, &mid, &r);
+    statFreeTree(mid);
+    config.statRoot = statMerge(statMerge(l, u->tree), r);
+    free(u->gone);
+    free(u->goneAt);
+    free(u->source);
+    u->set = 0;
+    config.dirty++;
+    cursorToRange(u->from);
+    setStatusMsg("Undone, %d lines back in %.1f ms", u->rows, (nowUs() - start) / 1000.0);
 }
 
-/**----output----**/
+//Part of a merge sort of row numbers, halves are split off to threads while depth lasts
+typedef struct sortJob
+{
+    int *a, *tmp;
+    int lo, hi;
+    int depth;
+    const double *keys; //Leading numbers of the rows from base on, NULL to compare bytes
+    const unsigned long long *prefix; //First 8 bytes of the rows from base on, most significant first
+    int base;
+    int reverse;
+} sortJob;
 
+int sortCmp(const sortJob *s, int x, int y)
+{
+    int c = 0;
+    if(s->keys) c = (s->keys[x - s->base] > s->keys[y - s->base]) - (s->keys[x - s->base] < s->keys[y - s->base]);
+    if(c == 0) c = (s->prefix[x - s->base] > s->prefix[y - s->base]) - (s->prefix[x - s->base] < s->prefix[y - s->base]);
+    if(c == 0)
+    {
+        //Only rows starting alike are read, most compares stay in the prefix array
+        erow *a = &config.row[x], *b = &config.row[y];
+        c = memcmp(a->chars, b->chars, a->size < b->size ? a->size : b->size);
+        if(c == 0) c = (a->size > b->size) - (a->size < b->size);
+    }
+    return s->reverse ? -c : c;
+}
 
-int getWindowSize(unsigned short int *rows, unsigned short int *cols)
+//Stable, so equal rows keep their order
+void *mergeSort(void *arg)
 {
-    struct winsize ws;
-    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    sortJob *s = arg;
+    int n = s->hi - s->lo;
+    if(n < 16)
     {
-        if(write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+        for(int j = s->lo + 1; j<s->hi; j++)
         {
-            return -1;
+            int v = s->a[j], k = j;
+            while(k > s->lo && sortCmp(s, s->a[k-1], v) > 0)
+            {
+                s->a[k] = s->a[k-1];
+                k--;
+            }
+            s->a[k] = v;
         }
-        int k = getCursorPosition(rows, cols);
-        err("WTF");
-        return k;
+        return NULL;
+    }
+    int mid = s->lo + n / 2;
+    sortJob left = *s, right = *s;
+    left.hi = right.lo = mid;
+    left.depth = right.depth = s->depth - 1;
+    pthread_t tid;
+    int spawned = s->depth > 0 && pthread_create(&tid, NULL, mergeSort, &left) == 0;
+    if(!spawned) mergeSort(&left);
+    mergeSort(&right);
+    if(spawned) pthread_join(tid, NULL);
+    if(sortCmp(s, s->a[mid-1], s->a[mid]) <= 0) return NULL; //Already in order
+    int i = s->lo, j = mid, k = s->lo;
+    while(i < mid && j < s->hi) s->tmp[k++] = sortCmp(s, s->a[j], s->a[i]) < 0 ? s->a[j++] : s->a[i++];
+    while(i < mid) s->tmp[k++] = s->a[i++];
+    while(j < s->hi) s->tmp[k++] = s->a[j++];
+    memcpy(s->a + s->lo, s->tmp + s->lo, sizeof(int) * n);
+    return NULL;
+}
+
+//Moves the rows of a range into a new order, source gives the row of the range for each
+void reorderRange(int from, int n, int *source, int m)
+{
+    erow *rows = malloc(sizeof(erow) * (m + 1));
+    for(int j = 0; j<m; j++) rows[j] = config.row[from + source[j]];
+    replaceRange(from, n, rows, m, source);
+    free(rows);
+}
 
+/**
+ * @brief Sorts the selected lines or the whole document by bytes
+ *
+ * @param reverse
+ * @param numeric compares the numbers the lines start with first
+ */
+void sortRows(int reverse, int numeric)
+{
+    long long start = nowUs();
+    int from, to;
+    commandRange(&from, &to);
+    int n = to - from;
+    loadRows(from, to);
+    unsigned long long *prefix = malloc(sizeof(unsigned long long) * (n + 1));
+    for(int j = 0; j<n; j++)
+    {
+        erow *row = &config.row[from + j];
+        prefix[j] = 0;
+        for(int k = 0; k<8; k++) prefix[j] = prefix[j] << 8 | (k < row->size ? (unsigned char)row->chars[k] : 0);
     }
-    else {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
+    sortJob job = {malloc(sizeof(int) * (n + 1)), malloc(sizeof(int) * (n + 1)), 0, n, 0, NULL, prefix, from, reverse};
+    double *keys = NULL;
+    if(numeric)
+    {
+        keys = malloc(sizeof(double) * (n + 1));
+        for(int j = 0; j<n; j++)
+        {
+            keys[j] = strtod(config.row[from + j].chars, NULL);
+            if(keys[j] != keys[j]) keys[j] = 0; //NaN
+        }
+        job.keys = keys;
+    }
+    int threads = threadCount(n);
+    while(1 << job.depth < threads) job.depth++;
+    for(int j = 0; j<n; j++) job.a[j] = from + j;
+    mergeSort(&job);
+    for(int j = 0; j<n; j++) job.a[j] -= from;
+    free(job.tmp);
+    free(keys);
+    free(prefix);
+    reorderRange(from, n, job.a, n);
+    setStatusMsg("Sorted %d lines in %.1f ms on %d thread%s", n, (nowUs() - start) / 1000.0, threads, threads > 1 ? "s" : "");
+}
+
+//Rows of a range handed to one thread
+typedef struct lineJob
+{
+    int from, to;
+    const char *text; //Looked for by keep and drop
+    size_t len;
+    unsigned long long *hash; //Filled for unique
+    char *match; //Filled for keep and drop
+    int base; //First row of the range, hash and match start there
+} lineJob;
+
+void *hashLines(void *arg)
+{
+    lineJob *job = arg;
+    for(int j = job->from; j<job->to; j++) job->hash[j - job->base] = hashBytes(config.row[j].chars, config.row[j].size);
+    return NULL;
+}
+
+void *matchLines(void *arg)
+{
+    lineJob *job = arg;
+    for(int j = job->from; j<job->to; j++)
+    {
+        job->match[j - job->base] = memmem(config.row[j].chars, config.row[j].size, job->text, job->len) != NULL;
     }
-
-
+    return NULL;
 }
 
-
-void scroll()
+//Runs fn over the rows [from, to) split evenly among threads
+int runLineJobs(void *(*fn)(void *), lineJob *proto, int from, int to)
 {
-    config.rx = 0;
-    if(config.cy<config.numrow)
+    int n = threadCount(to - from);
+    lineJob jobs[THREADS_MAX];
+    pthread_t tid[THREADS_MAX];
+    int started[THREADS_MAX];
+    for(int t = 0; t<n; t++)
     {
-        config.rx = RowCxToRx(&config.row[config.cy], config.cx);
+        jobs[t] = *proto;
+        jobs[t].base = from;
+        jobs[t].from = from + (long long)(to - from) * t / n;
+        jobs[t].to = from + (long long)(to - from) * (t + 1) / n;
+        started[t] = t > 0 && pthread_create(&tid[t], NULL, fn, &jobs[t]) == 0;
     }
-    if(config.cy<config.rowOff)
+    for(int t = 0; t<n; t++)
     {
-        
-        config.rowOff = config.cy;
+        if(!started[t]) fn(&jobs[t]);
     }
-    if(config.cy >= config.rowOff + config.screenrows)
+    for(int t = 1; t<n; t++)
     {
-        config.rowOff = config.cy-config.screenrows + 1;
+        if(started[t]) pthread_join(tid[t], NULL);
     }
-    if(config.rx < config.colOff)
+    return n;
+}
+
+//Removes repeated lines from the selection or the whole document, the first of each stays
+void uniqueRows()
+{
+    long long start = nowUs();
+    int from, to;
+    commandRange(&from, &to);
+    int n = to - from;
+    loadRows(from, to);
+    lineJob job = {0, 0, NULL, 0, malloc(sizeof(unsigned long long) * (n + 1)), NULL, 0};
+    int threads = runLineJobs(hashLines, &job, from, to);
+
+    //Open addressing over the places of the first lines of each kind
+    int size = 16;
+    while(size < 2 * n) size *= 2;
+    int *table = malloc(sizeof(int) * size);
+    memset(table, -1, sizeof(int) * size);
+    int *source = malloc(sizeof(int) * (n + 1));
+    int m = 0;
+    for(int j = 0; j<n; j++)
     {
-        config.colOff = config.rx;
+        erow *row = &config.row[from + j];
+        int slot = job.hash[j] & (size - 1);
+        int seen = 0;
+        while(table[slot] != -1)
+        {
+            erow *other = &config.row[from + table[slot]];
+            if(job.hash[table[slot]] == job.hash[j] && other->size == row->size && !memcmp(other->chars, row->chars, row->size))
+            {
+                seen = 1;
+                break;
+            }
+            slot = (slot + 1) & (size - 1);
+        }
+        if(seen) continue;
+        table[slot] = j;
+        source[m++] = j;
     }
-    if(config.rx >= config.colOff + config.screencols)
+    free(table);
+    free(job.hash);
+    reorderRange(from, n, source, m);
+    setStatusMsg("Removed %d repeated lines of %d in %.1f ms on %d thread%s", n - m, n, (nowUs() - start) / 1000.0,
+        threads, threads > 1 ? "s" : "");
+}
+
+/**
+ * @brief Keeps or drops the lines which contain text
+ *
+ * @param text
+ * @param keep
+ */
+void filterRows(const char *text, int keep)
+{
+    long long start = nowUs();
+    int from, to;
+    commandRange(&from, &to);
+    int n = to - from;
+    loadRows(from, to);
+    lineJob job = {0, 0, text, strlen(text), NULL, malloc(n + 1), 0};
+    int threads = runLineJobs(matchLines, &job, from, to);
+    int *source = malloc(sizeof(int) * (n + 1));
+    int m = 0;
+    for(int j = 0; j<n; j++)
     {
-        config.colOff = config.rx-config.screencols + 1;
+        if(job.match[j] == keep) source[m++] = j;
     }
+    free(job.match);
+    reorderRange(from, n, source, m);
+    setStatusMsg("%s %d lines of %d in %.1f ms on %d thread%s", keep ? "Kept" : "Dropped", keep ? m : n - m, n,
+        (nowUs() - start) / 1000.0, threads, threads > 1 ? "s" : "");
+}
 
+//Writes vectors fully to a pipe by mapping the pages into it
+int vmspliceAll(int fd, struct iovec *iov, int n)
+{
+    while(n)
+    {
+        ssize_t done = vmsplice(fd, iov, n, 0);
+        if(done == -1 && errno == EINTR) continue;
+        if(done == -1) return -1;
+        while(n && (size_t)done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if(n)
+        {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
 }
+
+//Input of a command run on a range of rows
+typedef struct pipeFeed
+{
+    int fd;
+    int from, to;
+} pipeFeed;
+
 /**
- * @brief This function draws the rows of the editor
+ * @brief Writes rows into a command without copying them
  *
- * @param ab
+ * Rows still only in the opened file go from the file to the pipe with splice,
+ * a whole run of adjacent lines at once. Loaded rows are mapped into the pipe
+ * with vmsplice. The pipe is closed at the end so the command sees EOF.
  */
-void drawRows(abuf *ab)
+void *feedRows(void *arg)
 {
-    for(int y = 0; y<config.screenrows; y++)
+    pipeFeed *f = arg;
+    struct iovec iov[PIPE_IOV];
+    int n = 0;
+    int failed = 0;
+    for(int j = f->from; j<f->to && !failed; j++)
     {
-        int filerow = y+config.rowOff;
-        if(filerow >= config.numrow)
+        erow *row = &config.row[j];
+        if(row->chars == NULL)
         {
-            if(y>=config.numrow)
+            if(n) failed = vmspliceAll(f->fd, iov, n);
+            n = 0;
+            loff_t off = row->foff;
+            off_t end = row->foff + row->size;
+            while(j + 1 < f->to && config.row[j+1].chars == NULL && config.row[j+1].foff == end + 1)
             {
-                if(config.numrow == 0 && y == config.screenrows/3)
-                {
-                    char welcomemsg[80] = {0};
-                    int msglen = snprintf(welcomemsg, sizeof(welcomemsg), "TextEditor Version %s", VER);
-                    if(msglen > config.screencols) msglen = config.screencols;
-                    int padding = (config.screencols - msglen) / 2;
-                    if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                    }
-                    while (padding--) abAppend(ab, " ", 1);
-                    abAppend(ab, welcomemsg, msglen);
-
-                }
-                else
-                {
-                    abAppend(ab, "~", 1);
-                }
+                j++;
+                end = config.row[j].foff + config.row[j].size;
+            }
+            while(!failed && off < end)
+            {
+                ssize_t done = splice(config.srcFd, &off, f->fd, NULL, end - off, SPLICE_F_MORE);
+                if(done <= 0 && !(done == -1 && errno == EINTR)) failed = 1;
             }
         }
         else
         {
-            int len = config.row[filerow].rsize - config.colOff;
-            if(len<0) len = 0;
-            if(len > config.screencols) len = config.screencols;
-            abAppend(ab, &config.row[filerow].render[config.colOff], len);
+            iov[n].iov_base = row->chars;
+            iov[n++].iov_len = row->size;
+        }
+        iov[n].iov_base = "\n";
+        iov[n++].iov_len = 1;
+        if(n >= PIPE_IOV - 1)
+        {
+            failed = failed || vmspliceAll(f->fd, iov, n);
+            n = 0;
         }
-        abAppend(ab, "\x1b[K", 3); //For clearing one line at a time
-        // if(y < config.screenrows-1)
-        // {
-        abAppend(ab, "\r\n", 2);
-        // }
-
     }
+    if(n && !failed) vmspliceAll(f->fd, iov, n);
+    close(f->fd);
+    return NULL;
 }
 
-void drawStatusBar(abuf *ab)
+/**
+ * @brief Replaces the selected lines or the whole document with the output of a shell command
+ *
+ * @param cmd run with sh -c, the lines are its input
+ * @return int -1 if the command could not be run or failed, with errno set
+ */
+int pipeRows(const char *cmd)
 {
-    abAppend(ab, "\x1b[7m", 4);
-    char status[100];
-    char lno[30]; //Shows line number
-
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        config.filename ? config.filename : "[Untitled]", config.numrow,
-        config.dirty != 0 ? "(modified)" : "(Unmodified)");
-    int rlen = snprintf(lno, sizeof(lno), "Ln %d, Col %d", config.cy+1, config.cx + 1);
-    if(len > config.screencols) len = config.screencols;
-    abAppend(ab, status , len);
-    while(len<config.screencols)
+    long long start = nowUs();
+    int from, to;
+    commandRange(&from, &to);
+    int in[2], out[2];
+    if(pipe2(in, O_CLOEXEC) == -1) return -1;
+    if(pipe2(out, O_CLOEXEC) == -1)
     {
-        if(config.screencols - len == rlen)
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        setpgid(0, 0); //Cancelling kills everything the shell started
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        if(null != -1) dup2(null, STDERR_FILENO); //Keep the command from writing over the screen
+        signal(SIGPIPE, SIG_DFL); //Commands like head rely on it to stop their input
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    if(pid > 0) setpgid(pid, pid); //Either side may get there first
+    close(in[0]);
+    close(out[1]);
+    //Input is written by a thread while the output is read here, a full pipe can't block both
+    pipeFeed feed = {in[1], from, to};
+    pthread_t tid;
+    if(pid == -1 || pthread_create(&tid, NULL, feedRows, &feed) != 0)
+    {
+        int saved = errno;
+        close(in[1]);
+        close(out[0]);
+        if(pid != -1) waitpid(pid, NULL, 0);
+        errno = saved;
+        return -1;
+    }
+    //A command which hangs is killed with ESC or Ctrl-C, other keys typed meanwhile wait for it
+    int watch = config.rawMode || config.serving; //Batch mode has no one to press them
+    if(watch)
+    {
+        setStatusMsg("Running %s (ESC to cancel)", cmd);
+        refreshScreen();
+    }
+    abuf text = ABUF_INIT;
+    static char buf[PIPE_BUF_SIZE];
+    int cancelled = 0;
+    //A replay takes the keys of the run up to the mark the recording left when the command finished
+    while(config.replay && !cancelled)
+    {
+        char c;
+        if(readByte(&c, 1) != 1) break;
+        cancelled = queueKey(finishKey(c));
+    }
+    while(!cancelled)
+    {
+        struct pollfd pfd[2] = {{out[0], POLLIN, 0}, {config.inFd, POLLIN, 0}};
+        if(poll(pfd, watch ? 2 : 1, -1) == -1)
         {
-            abAppend(ab, lno, rlen);
+            if(errno == EINTR) continue;
             break;
         }
-        else
+        if(watch && pfd[1].revents)
         {
-            abAppend(ab, " ", 1);
-            len++;
+            char c;
+            if(readByte(&c, 1) == 1) cancelled = queueKey(finishKey(c));
+            else if(pfd[1].revents & (POLLHUP | POLLERR)) cancelled = 1; //The terminal is gone
+            continue;
         }
+        if(!pfd[0].revents) continue;
+        ssize_t got = read(out[0], buf, sizeof(buf));
+        if(got == -1 && errno == EINTR) continue;
+        if(got <= 0) break;
+        abAppend(&text, buf, got);
+    }
+    if(cancelled) kill(-pid, SIGKILL);
+    else if(config.record) recordByte(-1); //The mark a replay stops taking keys at
+    close(out[0]); //The feeder gets EPIPE if the command is gone
+    pthread_join(tid, NULL);
+    int status;
+    if(waitpid(pid, &status, 0) == -1 || cancelled || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        abFree(&text);
+        errno = cancelled ? ECANCELED : ECHILD;
+        return -1;
+    }
 
+    int cap = 64, m = 0;
+    erow *rows = malloc(sizeof(erow) * cap);
+    char *p = text.s, *end = text.s + text.len;
+    while(p < end)
+    {
+        char *nl = memchr(p, '\n', end - p);
+        int len = (nl ? nl : end) - p;
+        if(m == cap)
+        {
+            cap *= 2;
+            rows = realloc(rows, sizeof(erow) * cap);
+        }
+        erow *row = &rows[m++];
+        row->size = len > 0 && p[len-1] == '\r' ? len - 1 : len;
+        row->chars = malloc(row->size + 1);
+        memcpy(row->chars, p, row->size);
+        row->chars[row->size] = '\0';
+        row->rsize = 0;
+        row->render = NULL;
+        row->foff = 0;
+        row->fields = NULL;
+        row->nfields = -1;
+        row->nest = NULL;
+        p += len + 1;
     }
-    abAppend(ab, "\x1b[0m", 4);
-    abAppend(ab, "\r\n", 2);
+    abFree(&text);
+    int *source = malloc(sizeof(int) * (m + 1));
+    for(int j = 0; j<m; j++) source[j] = -1;
+    replaceRange(from, to - from, rows, m, source);
+    free(rows);
+    setStatusMsg("Piped %d lines through the command, got %d in %.1f ms", to - from, m, (nowUs() - start) / 1000.0);
+    return 0;
+}
 
+/**batch mode**/
+
+//Turns \n, \t and \\ in a script argument into the characters
+void unescape(char *s)
+{
+    char *out = s;
+    for(; *s; s++)
+    {
+        if(*s == '\\' && s[1])
+        {
+            s++;
+            *out++ = *s == 'n' ? '\n' : *s == 't' ? '\t' : *s;
+        }
+        else *out++ = *s;
+    }
+    *out = 0;
 }
-void setStatusMsg(const char *fmt, ...)
+
+void insertText(const char *s)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(config.statusMsg, sizeof(config.statusMsg), fmt, ap);
-    va_end(ap);
-    config.statusMsgTime = time(NULL);
+    for(; *s; s++)
+    {
+        if(*s == '\n') insertNewLine();
+        else insertChar((unsigned char)*s);
+    }
 }
 
-void drawMsgBar(abuf *ab)
+void deleteLines(int n)
 {
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\x1b[7m", 4);
-    int msglen = strlen(config.statusMsg);
-    if(msglen > config.screencols) msglen = config.screencols;
-    if(time(NULL) - config.statusMsgTime < 3)
+    while(n-- > 0)
     {
-        if(msglen != 0)
+        indexRows(config.cy + 1);
+        if(config.cy >= config.numrow) break;
+        DelRow(config.cy);
+    }
+    config.cx = 0;
+}
+
+/**
+ * @brief Moves the cursor to the first match of query at or after it
+ *
+ * @param query
+ * @return int -1 if there is none
+ */
+int findForward(const char *query)
+{
+    size_t qlen = strlen(query);
+    for(int at = config.cy; ; at++)
+    {
+        indexRows(at + 1);
+        if(at >= config.numrow) return -1;
+        erow *row = rowAt(at);
+        int from = at == config.cy ? config.cx : 0;
+        if(from > row->size) continue;
+        char *match = memmem(row->chars + from, row->size - from, query, qlen);
+        if(match)
         {
-            abAppend(ab, "\x1b[7m", 4);
-            abAppend(ab, config.statusMsg, msglen);
+            config.cy = at;
+            config.cx = match - row->chars;
+            return 0;
         }
-        for(int i = 0; i<config.screencols - msglen; i++)
+    }
+}
+
+/**
+ * @brief Replaces every occurrence of from, only rows which match are rewritten
+ *
+ * @param from
+ * @param to
+ * @return int number of replacements
+ */
+int replaceAll(const char *from, const char *to)
+{
+    size_t flen = strlen(from), tlen = strlen(to);
+    if(flen == 0) return 0;
+    indexRows(INT_MAX);
+    int count = 0;
+    abuf out = ABUF_INIT;
+    for(int at = 0; at<config.numrow; at++)
+    {
+        erow *row = rowAt(at);
+        char *p = row->chars;
+        char *end = p + row->size;
+        char *match;
+        if(!memmem(p, row->size, from, flen)) continue;
+        out.len = 0;
+        while((match = memmem(p, end - p, from, flen)) != NULL)
         {
-            abAppend(ab, " ", 1);
+            abAppend(&out, p, match - p);
+            abAppend(&out, to, tlen);
+            p = match + flen;
+            count++;
         }
+        abAppend(&out, p, end - p);
+        rowSetText(row, out.s, out.len);
     }
-    else
+    abFree(&out);
+    moveToRow(config.cy); //clamps cx to the new row length
+    return count;
+}
+
+/**
+ * @brief Runs one script command against the document
+ *
+ * Commands: goto TARGET, insert TEXT, delete-lines [N], find TEXT,
+ * replace /OLD/NEW/ (any delimiter) and save [PATH].
+ *
+ * @param cmd
+ * @param arg may be modified
+ * @return int -1 if the command failed
+ */
+int runCommand(const char *cmd, char *arg)
+{
+    if(strcmp(cmd, "goto") == 0)
     {
-        for(int i = 0; i<config.screencols; i++)
+        int at, cx;
+        if(parseTarget(arg, &at, &cx) == -1) return -1;
+        config.cx = cx;
+        moveToRow(at);
+    }
+    else if(strcmp(cmd, "insert") == 0)
+    {
+        unescape(arg);
+        insertText(arg);
+    }
+    else if(strcmp(cmd, "delete-lines") == 0)
+    {
+        deleteLines(*arg ? atoi(arg) : 1);
+    }
+    else if(strcmp(cmd, "find") == 0)
+    {
+        unescape(arg);
+        return findForward(arg);
+    }
+    else if(strcmp(cmd, "replace") == 0)
+    {
+        char delim = arg[0];
+        char *mid = delim ? strchr(arg + 1, delim) : NULL;
+        if(mid == NULL) return -1;
+        *mid = 0;
+        char *end = strchr(mid + 1, delim);
+        if(end) *end = 0;
+        unescape(arg + 1);
+        unescape(mid + 1);
+        replaceAll(arg + 1, mid + 1);
+    }
+    else if(strcmp(cmd, "save") == 0)
+    {
+        if(*arg)
         {
-            abAppend(ab, " ", 1);
-        }        
+            free(config.filename);
+            config.filename = strdup(arg);
+        }
+        long long len, stored;
+        if(config.filename == NULL || saveDocument(&len, &stored) == -1) return -1;
+    }
+    else if(strcmp(cmd, "sort") == 0)
+    {
+        int reverse = arg[0] == '-' && strchr(arg, 'r');
+        int numeric = arg[0] == '-' && strchr(arg, 'n');
+        sortRows(reverse, numeric);
+    }
+    else if(strcmp(cmd, "unique") == 0)
+    {
+        uniqueRows();
+    }
+    else if(strcmp(cmd, "keep") == 0 || strcmp(cmd, "drop") == 0)
+    {
+        unescape(arg);
+        if(*arg == 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        filterRows(arg, cmd[0] == 'k');
+    }
+    else if(strcmp(cmd, "pipe") == 0)
+    {
+        return pipeRows(arg);
+    }
+    else if(strcmp(cmd, "undo") == 0)
+    {
+        undoRange();
+    }
+    else
+    {
+        errno = EINVAL;
+        return -1;
     }
+    return 0;
+}
 
-    
-    abAppend(ab, "\x1b[m", 3);
+//Ctrl-X, runs a batch command on the selected lines or the whole document
+void commandPrompt()
+{
+    char *line = promptUser("Command: %s (sort [-rn], unique, keep TEXT, drop TEXT, pipe CMD; ESC to cancel)", NULL);
+    if(line == NULL) return;
+    char *arg = strchr(line, ' ');
+    if(arg) *arg++ = 0;
+    else arg = line + strlen(line);
+    config.unfolded = 0;
+    if(runCommand(line, arg) == -1)
+    {
+        setStatusMsg("%s failed: %s", line, errno == ECHILD ? "the command did not exit with 0" : strerror(errno));
+    }
+    else if(config.unfolded)
+    {
+        size_t used = strlen(config.statusMsg);
+        snprintf(config.statusMsg + used, sizeof(config.statusMsg) - used, ", unfolded %d lines", config.unfolded);
+    }
+    free(line);
 }
+
 /**
- * @brief This function refreshes the screen after every keypress
+ * @brief Applies a command script to every file without touching the terminal
  *
+ * @param script
+ * @param files
+ * @param nfiles
+ * @return int exit status
  */
-void refreshScreen()
+int runBatch(const char *script, char **files, int nfiles)
 {
-    scroll();
-    abuf ab = ABUF_INIT;
-    //0x1b-27
-
-    // //2 clears entire screen 0-till cursor 1-cursor till end
-    // abAppend(&ab, "\x1b[2J", 4);
-    abAppend(&ab, "\x1b[?25l", 6);
-    //Positioning cursor at beginning
-    abAppend(&ab,  "\x1b[H", 3);
-
-    //then drawing
-    drawRows(&ab);
-    drawStatusBar(&ab);
-    drawMsgBar(&ab);
-
-
-    char buf[32];
-    int length = snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-                    (config.cy - config.rowOff+1), (config.rx - config.colOff + 1));
-    if(length  == 0) err("Cursor error");
-    abAppend(&ab, buf, strlen(buf));
-
-    abAppend(&ab, "\x1b[?25h", 6);
+    FILE *fp = fopen(script, "r");
+    if(!fp)
+    {
+        perror(script);
+        return 1;
+    }
+    //The script is parsed once and replayed for every file
+    char **lines = NULL;
+    int nlines = 0;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while((linelen = getline(&line, &linecap, fp)) != -1)
+    {
+        while(linelen > 0 && (line[linelen-1] == '\r' || line[linelen-1] == '\n')) line[--linelen] = 0;
+        if(linelen == 0 || line[0] == '#') continue;
+        lines = realloc(lines, sizeof(char *) * (nlines + 1));
+        lines[nlines++] = strdup(line);
+    }
+    free(line);
+    fclose(fp);
 
-    //Writes all the buffer at once
-    write(STDOUT_FILENO, ab.s, ab.len);
-    abFree(&ab);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = 0;
+    char *buf = NULL;
+    size_t bufcap = 0;
+    initDocument();
+    for(int f = 0; f<nfiles; f++)
+    {
+        if(openDocument(files[f]) == -1)
+        {
+            perror(files[f]);
+            failed++;
+            closeDocument();
+            continue;
+        }
+        for(int j = 0; j<nlines; j++)
+        {
+            size_t len = strlen(lines[j]) + 1;
+            if(len > bufcap)
+            {
+                bufcap = len;
+                buf = realloc(buf, bufcap);
+            }
+            memcpy(buf, lines[j], len); //Commands modify their argument
+            char *arg = strchr(buf, ' ');
+            if(arg) *arg++ = 0;
+            else arg = buf + len - 1;
+            if(runCommand(buf, arg) == -1)
+            {
+                fprintf(stderr, "%s: line %d: %s failed\n", files[f], j + 1, buf);
+                failed++;
+                break;
+            }
+        }
+        closeDocument();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%d files, %d failed, %.3f s\n", nfiles, failed, secs);
+    for(int j = 0; j<nlines; j++) free(lines[j]);
+    free(lines);
+    free(buf);
+    return failed ? 1 : 0;
 }
 
-
 /**init**/
 
 /**
- * @brief This function initializes the editor
+ * @brief Resets the document part of the state, nothing here knows about the terminal
  *
  */
-void initEditor()
+void initDocument()
 {
     config.cx = config.cy = 0;
     config.numrow = 0;
     config.row = NULL;
+    config.rowCap = 0;
+    config.srcFd = -1;
+    config.srcSize = config.scanOff = config.lineStart = 0;
+    config.scanWords = config.scanInWord = 0;
+    config.scanNest = (nesting)NESTING_INIT;
+    config.statCap = 1024;
+    config.stat = calloc(config.statCap, sizeof(statNode)); //Node 0 stands for the empty tree
+    config.statUsed = 1;
+    config.statFree = config.statRoot = 0;
+    config.markSet = 0;
+    config.compress = 0;
+    config.blockHash = NULL;
+    config.blockCap = 0;
+    config.hashOff = 0;
+    memset(&config.disk, 0, sizeof(config.disk));
+    config.diskChecked = 0;
+    config.diskChanged = config.diskPartial = 0;
+    config.columnMode = 0;
+    config.ncursors = 0;
+    config.undo.set = 0;
+    config.colCount = config.colFrom = config.colTo = config.colStale = 0;
     config.rowOff = config.colOff = 0;
     config.rx = 0;
     config.filename = NULL;
+    config.dirty = 0;
+}
+
+/**
+ * @brief This function initializes the editor
+ *
+ */
+void initEditor()
+{
+    config.inFd = STDIN_FILENO;
+    config.outFd = STDOUT_FILENO;
+    initDocument();
+    config.searchHistory.len = 0;
     config.statusMsg[0] = 0;
     config.statusMsgTime = 0;
-    config.dirty = 0;
-    if(getWindowSize(&config.screenrows, &config.screencols) == -1) err("getWindowSize");
+    //A replay draws at the size it was recorded with, a server at the size of each client
+    if(!config.replay && !config.serving && getWindowSize(&config.screenrows, &config.screencols) == -1) err("getWindowSize");
     config.screenrows -= 2; //Making two empty space at bottom of the screen
+    termInit();
 }
 int main(int argc, char *argv[])
 {
-    enableRawMode();
+    signal(SIGPIPE, SIG_IGN); //A compressor which died shows up as a failed write
+    if(argc >= 2 && strcmp(argv[1], "-b") == 0)
+    {
+        if(argc < 3)
+        {
+            fprintf(stderr, "Usage: %s -b script [file...]\n", argv[0]);
+            return 1;
+        }
+        return runBatch(argv[2], argv + 3, argc - 3);
+    }
+    if(argc >= 2 && strcmp(argv[1], "-c") == 0)
+    {
+        if(argc < 3)
+        {
+            fprintf(stderr, "Usage: %s -c file\n", argv[0]);
+            return 1;
+        }
+        return runClient(argv[2]);
+    }
+    char *recording = NULL;
+    if(argc >= 3 && strcmp(argv[1], "-r") == 0)
+    {
+        recording = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    else if(argc >= 3 && strcmp(argv[1], "-p") == 0)
+    {
+        if(startReplay(argv[2]) == -1)
+        {
+            perror(argv[2]);
+            return 1;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if(!config.replay)
+    {
+        enableRawMode();
+        probeTerminal();
+    }
     initEditor();
+    if(recording && startRecording(recording) == -1) err(recording);
     if(argc >= 2)
     {
-        editorOpen(argv[1]);
+        if(editorOpen(argv[1]) == -1) err(argv[1]);
     }
-    setStatusMsg("HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = find");
+    setStatusMsg("HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = find | Ctrl-G = goto | Ctrl-E = columns | Ctrl-K = fold | Ctrl-A = cursors | Ctrl-B = hex | Ctrl-] = bracket | Ctrl-X = command | Ctrl-Z = undo | Ctrl-Space = mark");
     while(1)
     {
         refreshScreen();